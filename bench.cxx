@@ -0,0 +1,825 @@
+/*!
+ * diffedit benchmarks: micro benchmarks of the pipeline kernels, then
+ * the read, parse, fold and render stages over a generated corpus
+ * (build with "make bench", run ./bench [-o results.json] [-g corpus_dir])
+ */
+
+#define DIFFEDIT_NO_MAIN
+#include "diffedit.cxx"
+#include <time.h>
+#include <new>
+
+#define BENCH_LINES (2000000)
+#define LINEBUFSIZE (256)
+
+// every operator new of the run is counted; out of line as in diffedit
+static long allocations;
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+  operator delete(p);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one measurement, also kept for the results file
+struct Result
+{
+  std::string name;
+  long count;
+  const char* unit;
+  double sec;
+  size_t bytes; // input bytes processed, 0 when not meaningful
+};
+static std::vector<Result> results;
+
+static void report(const char* name, long count, const char* unit, double sec,
+                   size_t bytes = 0)
+{
+  printf("%-24s %10ld %s %8.3f sec %14.0f %s/sec", name, count, unit, sec, count / sec, unit);
+  if (bytes) printf(" %8.1f MB/sec", bytes / sec / (1024 * 1024));
+  printf("\n");
+  fflush(stdout);
+  Result result = { name, count, unit, sec, bytes };
+  results.push_back(result);
+}
+
+// the results as JSON, so that runs of different versions can be compared
+static void write_results(const char* filename)
+{
+  FILE* fp = fopen(filename, "w");
+  if (!fp) THROW_EXCEPTION("fopen(%s) %s", filename, strerror(errno));
+  fprintf(fp, "{\n  \"version\": \"%s\",\n  \"simd\": \"%s\",\n  \"results\": [\n",
+          VERSION, simd_path);
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    fprintf(fp, "    {\"name\": \"%s\", \"count\": %ld, \"unit\": \"%s\", "
+            "\"sec\": %.6f, \"per_sec\": %.0f, \"bytes\": %lu}%s\n",
+            r.name.c_str(), r.count, r.unit, r.sec, r.count / r.sec,
+            (unsigned long)r.bytes, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  if (fclose(fp)) THROW_EXCEPTION("fclose(%s) %s", filename, strerror(errno));
+}
+
+// unified diff shaped input: context, removed and added lines
+static FILE* make_patch(int lines)
+{
+  FILE* fp = tmpfile();
+  if (!fp) THROW_EXCEPTION("tmpfile() %s", strerror(errno));
+  fprintf(fp, "Index: bench.c\n@@ -1,%d +1,%d @@\n", lines, lines);
+  for (int i = 0; i < lines; i++) {
+    char mark = (i % 7 == 3) ? '-' : (i % 7 == 4) ? '+' : ' ';
+    fprintf(fp, "%c  line %d of the benchmark input\tvalue = %d;\n", mark, i, i * 3);
+  }
+  fflush(fp);
+  return fp;
+}
+
+// LINEBUFSIZE line normalization shipped up to 1.1, kept as reference
+static bool is_ascii(unsigned char c)
+{
+  if (0x00 <= c && c <= 0x7F)
+    return true;
+  return false;
+}
+
+static bool is_sjis_hankana(unsigned char c)
+{
+  if (0xA1 <= c && c <= 0xDF)
+    return true;
+  return false;
+}
+
+static bool is_sjis_zenkaku(unsigned char* c)
+{
+  if ((0x81 <= *c && *c <= 0x9F) || (0xE0 <= *c && *c <= 0xFC))
+    if ((0x40 <= *(c+1) && *(c+1) <= 0x7E) || (0x80 <= *(c+1) && *(c+1) <= 0xFC))
+      return true;
+  return false;
+}
+
+static bool is_euc_hankana(unsigned char* c)
+{
+  if (*c == 0x8E)
+    if (0xA1 <= *(c+1) && *(c+1) <= 0xDF)
+      return true;
+  return false;
+}
+
+static bool is_euc_zenkaku(unsigned char* c)
+{
+  if (0xA1 <= *c || *c <= 0xFE)
+    if (0xA1 <= *c || *c <= 0xFE)
+      return true;
+  return false;
+}
+
+static bool is_utf8_2byte(unsigned char* c)
+{
+  if (0xC2 <= *c && *c <= 0xDF)
+    if (0x80 <= *(c+1) && *(c+1) <= 0xBF)
+      return true;
+  return false;
+}
+
+static bool is_utf8_3byte(unsigned char* c)
+{
+  if (0xE0 <= *c && *c <= 0xEF)
+    if (0x80 <= *(c+1) && *(c+1) <= 0xBF)
+      if (0x80 <= *(c+2) && *(c+2) <= 0xBF)
+        return true;
+  return false;
+}
+
+static int legacy_strcolumlen(char* str)
+{
+  int col = 0;
+  int max = strlen(str);
+  unsigned char* in = (unsigned char*)str;
+  for (int i = 0; i < max;) {
+    if (is_ascii(in[i])) {
+      i += 1;
+      col += 1;
+    } else if (is_utf8_3byte(&in[i])) {
+      i += 3;
+      col += 2;
+    } else if (is_utf8_2byte(&in[i])  ||
+               is_euc_zenkaku(&in[i]) ||
+               is_sjis_zenkaku(&in[i])) {
+      i += 2;
+      col += 2;
+    } else if (is_euc_hankana(&in[i])) {
+      i += 2;
+      col += 1;
+    } else if (is_sjis_hankana(in[i])) {
+      i += 1;
+      col += 1;
+    } else {
+      i += 1;
+      col += 1;
+    }
+  }
+  return col;
+}
+
+static void legacy_cutLF(char* buf)
+{
+  char* p;
+  if ((p = strchr(buf, '\r'))) *p = 0;
+  if ((p = strchr(buf, '\n'))) *p = 0;
+}
+
+static void legacy_expandTAB(char* buf)
+{
+  char tmp[LINEBUFSIZE];
+  memset(tmp, 0, sizeof(tmp));
+  char* src = buf;
+  char* dst = tmp;
+
+  while(*src) {
+    if (*src == '\t') {
+      int n_sp = TABSIZE - (legacy_strcolumlen(tmp) % TABSIZE);
+      memset(dst, ' ', n_sp);
+      dst += n_sp;
+    } else {
+      *dst = *src;
+      dst++;
+    }
+    src++;
+  }
+  strcpy(buf, tmp);
+}
+
+// the std::list lookahead window Reader shipped up to 1.1, kept as reference
+class ListReader
+{
+public:
+  ListReader(FILE* fp, int cachesize = DEFAULT_READ_CACHE_SIZE)
+    : fp_(fp), cachesize_(cachesize), c_pos_(-1) {
+    for (int i = 0; i < cachesize_ + 1; i++) {
+      char* line = realread();
+      if (line)
+        cache_.push_back(new std::string(line));
+      else {
+        cachesize_ = i - 1;
+        break;
+      }
+    }
+  }
+  ~ListReader() {
+    for (std::list<std::string*>::iterator it = cache_.begin();
+         it != cache_.end(); it++)
+      delete *it;
+  }
+  char* readline() { forward(); return crnt(); }
+  char* prev() { return getstr(c_pos_ - 1); }
+  char* crnt() { return getstr(c_pos_); }
+  char* next() { return getstr(c_pos_ + 1); }
+private:
+  char* getstr(int pos) {
+    if (pos < 0)
+      return NULL;
+    int i = 0;
+    for (std::list<std::string*>::iterator it = cache_.begin();
+         it != cache_.end(); it++, i++) {
+      if (i == pos)
+        return normalize((*it)->c_str());
+    }
+    return NULL;
+  }
+  char* realread() {
+    static char line[LINEBUFSIZE];
+    if (!fgets(line, sizeof(line)-1, fp_))
+      return NULL;
+    return line;
+  }
+  void forward() {
+    if (c_pos_ == cachesize_ - 1) {
+      delete cache_.front();
+      cache_.pop_front();
+      char* line = realread();
+      if (line)
+        cache_.push_back(new std::string(line));
+    } else {
+      c_pos_++;
+    }
+  }
+  char* normalize(const char* buf) {
+    static char line[LINEBUFSIZE];
+    strncpy(line, buf, sizeof(line)-1);
+    legacy_cutLF(line);
+    legacy_expandTAB(line);
+    return line;
+  }
+  FILE* fp_;
+  int cachesize_;
+  int c_pos_;
+  std::list<std::string*> cache_;
+};
+
+static char head(const char* line) { return line ? line[0] : 0; }
+static char head(StrRef line) { return line.at(0); }
+
+static bool readline(ListReader* reader, StrRef* line)
+{
+  char* p = reader->readline();
+  if (p) *line = StrRef(p, strlen(p));
+  return p != NULL;
+}
+
+static bool readline(Reader* reader, StrRef* line)
+{
+  NormLine norm;
+  bool ok = reader->readline(&norm);
+  *line = norm;
+  return ok;
+}
+
+// the access pattern of UnifiedAnalyzer::getdiff for one input line
+template <class R>
+static long walk(R* reader)
+{
+  long lines = 0;
+  long sum = 0;
+  StrRef line;
+  while (readline(reader, &line)) {
+    sum += line.at(0);
+    sum += head(reader->prev());
+    sum += head(reader->crnt());
+    sum += head(reader->next());
+    sum += head(reader->prev());
+    sum += head(reader->next());
+    lines++;
+  }
+  if (sum == 42) printf(" ");
+  return lines;
+}
+
+static void bench_reader()
+{
+  FILE* fp = make_patch(BENCH_LINES);
+
+  rewind(fp);
+  double t = now();
+  ListReader* list = new ListReader(fp);
+  long n = walk(list);
+  delete list;
+  report("reader/list-window", n, "lines", now() - t);
+
+  rewind(fp);
+  t = now();
+  Reader* ring = new Reader(fp);
+  n = walk(ring);
+  delete ring;
+  report("reader/ring-window", n, "lines", now() - t);
+
+  fclose(fp);
+}
+
+#define BENCH_COLUMN_LINES (500000)
+
+// expand + measure as done by the normalize stage, legacy vs. kernel
+static void bench_columns(const char* name, const char* line)
+{
+  char buf[LINEBUFSIZE];
+  char label[64];
+  long sum = 0;
+
+  double t = now();
+  for (int i = 0; i < BENCH_COLUMN_LINES; i++) {
+    strcpy(buf, line);
+    legacy_expandTAB(buf);
+    sum += legacy_strcolumlen(buf);
+  }
+  snprintf(label, sizeof(label), "%s/legacy", name);
+  report(label, BENCH_COLUMN_LINES, "lines", now() - t);
+
+  const char* path = simd_path;
+  ascii_span_t span = ascii_span;
+  ascii_span_t paths[] = { ascii_span_scalar,
+#ifdef __SSE2__
+                           ascii_span_sse2,
+#endif
+                           span };
+  const char* names[] = { "scalar",
+#ifdef __SSE2__
+                          "sse2",
+#endif
+                          path };
+  std::string out;
+  for (size_t k = 0; k < sizeof(paths) / sizeof(paths[0]); k++) {
+    ascii_span = paths[k];
+    t = now();
+    for (int i = 0; i < BENCH_COLUMN_LINES; i++) {
+      int col;
+      expandTAB<EncodingAuto>(StrRef(line, strlen(line)), &out, &col);
+      sum += col;
+    }
+    snprintf(label, sizeof(label), "%s/%s", name, names[k]);
+    report(label, BENCH_COLUMN_LINES, "lines", now() - t);
+  }
+  ascii_span = span;
+  if (sum == 42) printf(" ");
+}
+
+// the sprintf/fprintf row assembly shipped up to 1.1, kept as reference
+class LegacyWriter
+{
+public:
+  LegacyWriter(int colum, FILE* fp) : colum_(colum), fp_(fp) {
+    left_ = (char*)malloc(colum_ * UTF8_MAX_BYTES + 1);
+    right_ = (char*)malloc(colum_ * UTF8_MAX_BYTES + 1);
+  }
+  ~LegacyWriter() { free(left_); free(right_); }
+  void format(int lno, NormLine l, int rno, NormLine r, char mode) {
+    char l_lno[8], r_lno[8];
+    sprintf(l_lno, lno ? "%5d" : "     ", lno);
+    sprintf(r_lno, rno ? "%5d" : "     ", rno);
+    fold(l, left_);
+    fold(r, right_);
+    fprintf(fp_, "%s %s |%c| %s %s\n", l_lno, left_, mode, r_lno, right_);
+  }
+private:
+  void fold(const NormLine& l, char* out) {
+    memcpy(out, l.ptr, l.len);
+    memset(out + l.len, ' ', colum_ - l.colums);
+    out[l.len + colum_ - l.colums] = 0;
+  }
+  int colum_;
+  FILE* fp_;
+  char* left_;
+  char* right_;
+};
+
+#define BENCH_ROWS (2000000)
+
+// side-by-side rows of measured lines that fit, written to /dev/null
+static void bench_writer()
+{
+  const char* text = "  int total = values[i] * weight + offset;";
+  NormLine line(StrRef(text, strlen(text)), strlen(text));
+
+  FILE* fp = fopen("/dev/null", "w");
+  if (!fp) THROW_EXCEPTION("fopen() %s", strerror(errno));
+  double t = now();
+  LegacyWriter* legacy = new LegacyWriter(DEFAULT_COLUM, fp);
+  for (int i = 1; i <= BENCH_ROWS; i++)
+    legacy->format(i, line, i + 3, line, MODE_MOD);
+  delete legacy;
+  fflush(fp);
+  report("writer/fprintf", BENCH_ROWS, "rows", now() - t);
+  fclose(fp);
+
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) THROW_EXCEPTION("open() %s", strerror(errno));
+  t = now();
+  OutBuf* out = new OutBuf(fd);
+  Writer<EncodingAuto>* writer = new Writer<EncodingAuto>(DEFAULT_COLUM, out);
+  for (int i = 1; i <= BENCH_ROWS; i++)
+    writer->format(i, line, i + 3, line, MODE_MOD);
+  delete writer;
+  delete out;
+  report("writer/outbuf", BENCH_ROWS, "rows", now() - t);
+  close(fd);
+}
+
+#define BENCH_HUNKS (200000)
+
+// a refactoring shaped patch: one changed line in every BENCH_HUNK_LINES,
+// rendered from a scratch directory holding the new file
+#define BENCH_HUNK_LINES (7)
+
+static void bench_hunks()
+{
+  char dir[] = "/tmp/diffedit-bench-XXXXXX";
+  if (!mkdtemp(dir)) THROW_EXCEPTION("mkdtemp() %s", strerror(errno));
+  std::string cwd(PATH_MAX, 0);
+  if (!getcwd(&cwd[0], cwd.size())) THROW_EXCEPTION("getcwd() %s", strerror(errno));
+  if (chdir(dir) < 0) THROW_EXCEPTION("chdir(%s) %s", dir, strerror(errno));
+
+  int lines = BENCH_HUNKS * BENCH_HUNK_LINES;
+  FILE* src = fopen("bench.c", "w");
+  FILE* fp = fopen("bench.patch", "w+");
+  if (!src || !fp) THROW_EXCEPTION("fopen() %s", strerror(errno));
+  fprintf(fp, "Index: bench.c\n@@ -1,%d +1,%d @@\n", lines, lines);
+  for (int i = 0; i < lines; i++) {
+    if (i % BENCH_HUNK_LINES == 3) {
+      fprintf(fp, "-  total = compute_old(values, %d);\n", i);
+      fprintf(fp, "+  total = compute_new(values, %d, weight);\n", i);
+      fprintf(src, "  total = compute_new(values, %d, weight);\n", i);
+    } else {
+      fprintf(fp, "   line %d of the benchmark input\n", i);
+      fprintf(src, "  line %d of the benchmark input\n", i);
+    }
+  }
+  fclose(src);
+  rewind(fp);
+
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) THROW_EXCEPTION("open() %s", strerror(errno));
+  for (int intraline = 0; intraline < 2; intraline++) {
+    const char* name = intraline ? "hunks/intraline" : "hunks/render";
+    rewind(fp);
+    long before = allocations;
+    double t = now();
+    OutBuf* out = new OutBuf(fd);
+    Analyzer* analyzer = Analyzer::create(new Reader(fp, ENCODING_UTF8));
+    Printer<Writer<EncodingUTF8> >* printer =
+      new Printer<Writer<EncodingUTF8> >(analyzer, new Writer<EncodingUTF8>(DEFAULT_COLUM, out));
+    printer->set_intraline(intraline);
+    printer->print();
+    delete printer;
+    delete out;
+    report(name, BENCH_HUNKS, "hunks", now() - t);
+    printf("%-24s %10ld allocations\n", name, allocations - before);
+  }
+  close(fd);
+
+  fclose(fp);
+  unlink("bench.c");
+  unlink("bench.patch");
+  if (chdir(cwd.c_str()) < 0) THROW_EXCEPTION("chdir(%s) %s", cwd.c_str(), strerror(errno));
+  rmdir(dir);
+}
+
+// deterministic xorshift numbers: a corpus is the same bytes on every run
+struct Rand
+{
+  Rand(uint64_t seed) : s_(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+  uint32_t next() {
+    s_ ^= s_ << 13;
+    s_ ^= s_ >> 7;
+    s_ ^= s_ << 17;
+    return s_ >> 32;
+  }
+  int below(int n) { return next() % n; }
+private:
+  uint64_t s_;
+};
+
+#define STYLE_CODE (0)
+#define STYLE_TABS (1)
+#define STYLE_LONG (2)
+#define STYLE_UTF8 (3)
+#define STYLE_SJIS (4)
+#define STYLE_EUC  (5)
+
+// one kind of input: its patch format ('u'nified or 'n'ormal), the line
+// style and the number and length of its files
+struct Corpus
+{
+  const char* name;
+  char format;
+  int style;
+  int files;
+  int lines;
+  int encoding;
+};
+
+static const Corpus corpora[] = {
+  { "small-files", 'u', STYLE_CODE, 2000,      40, ENCODING_UTF8 },
+  { "huge-file",   'u', STYLE_CODE,    1, 1000000, ENCODING_UTF8 },
+  { "long-lines",  'u', STYLE_LONG,   20,     400, ENCODING_UTF8 },
+  { "tab-heavy",   'u', STYLE_TABS,  100,    2000, ENCODING_UTF8 },
+  { "cjk-utf8",    'u', STYLE_UTF8,  100,    2000, ENCODING_UTF8 },
+  { "cjk-sjis",    'u', STYLE_SJIS,  100,    2000, ENCODING_SJIS },
+  { "cjk-euc",     'u', STYLE_EUC,   100,    2000, ENCODING_EUC  },
+  { "normal",      'n', STYLE_CODE, 2000,      40, ENCODING_UTF8 },
+};
+
+static const char* words[] = {
+  "int", "total", "value", "count", "return", "if", "for", "while", "buffer",
+  "line", "size", "(", ")", "{", "}", ";", "=", "+", "*", "->", "0", "1",
+  "i", "j", "p", "weight", "result", "const", "char*", "// note",
+};
+
+// a JIS X 0208 kanji in the encoding of the style
+static void put_kanji(Rand* r, int style, std::string* line)
+{
+  int j1 = 0x30 + r->below(40);
+  int j2 = 0x21 + r->below(94);
+  if (style == STYLE_EUC) {
+    line->push_back(j1 | 0x80);
+    line->push_back(j2 | 0x80);
+  } else if (style == STYLE_SJIS) {
+    int s1 = ((j1 - 0x21) >> 1) + 0x81;
+    if (s1 > 0x9F) s1 += 0x40;
+    int s2 = (j1 & 1) ? j2 + 0x1F : j2 + 0x7E;
+    if ((j1 & 1) && s2 >= 0x7F) s2++;
+    line->push_back(s1);
+    line->push_back(s2);
+  } else {
+    int cp = 0x4E00 + (j1 - 0x30) * 94 + (j2 - 0x21);
+    line->push_back(0xE0 | (cp >> 12));
+    line->push_back(0x80 | ((cp >> 6) & 0x3F));
+    line->push_back(0x80 | (cp & 0x3F));
+  }
+}
+
+static void make_line(Rand* r, int style, std::string* line)
+{
+  line->clear();
+  int nwords = sizeof(words) / sizeof(words[0]);
+  if (style == STYLE_TABS) {
+    for (int i = 1 + r->below(4); i > 0; i--)
+      line->push_back('\t');
+    for (int i = 2 + r->below(6); i > 0; i--) {
+      line->append(words[r->below(nwords)]);
+      line->push_back('\t');
+    }
+    return;
+  }
+  line->append(2 * r->below(5), ' ');
+  int tokens = style == STYLE_LONG ? 400 + r->below(800) : 3 + r->below(12);
+  for (int i = 0; i < tokens; i++) {
+    if (style >= STYLE_UTF8 && r->below(3)) {
+      for (int k = 1 + r->below(6); k > 0; k--)
+        put_kanji(r, style, line);
+    } else {
+      line->append(words[r->below(nwords)]);
+    }
+    line->push_back(' ');
+  }
+}
+
+// "N" or "N,M" of a normal diff range
+static void put_range(FILE* fp, int first, int count)
+{
+  if (count <= 1) fprintf(fp, "%d", first);
+  else fprintf(fp, "%d,%d", first, first + count - 1);
+}
+
+// writes the new files of the corpus into dir, and to patch the diff that
+// makes them from the old ones; changes of up to three lines each are
+// spread over every file and have three lines of context in unified form
+static void make_corpus(const Corpus& c, const std::string& dir, const std::string& patch)
+{
+  Rand r(hash_bytes(c.name, strlen(c.name)));
+  FILE* pp = fopen(patch.c_str(), "w");
+  if (!pp) THROW_EXCEPTION("fopen(%s) %s", patch.c_str(), strerror(errno));
+  std::vector<std::string> lines(c.lines);
+  std::string old;
+  for (int f = 0; f < c.files; f++) {
+    char name[32];
+    snprintf(name, sizeof(name), "f%05d.c", f);
+    std::string path = dir + "/" + name;
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) THROW_EXCEPTION("fopen(%s) %s", path.c_str(), strerror(errno));
+    for (int i = 0; i < c.lines; i++) {
+      make_line(&r, c.style, &lines[i]);
+      fprintf(fp, "%s\n", lines[i].c_str());
+    }
+    if (fclose(fp)) THROW_EXCEPTION("fclose(%s) %s", path.c_str(), strerror(errno));
+
+    if (c.format == 'u')
+      fprintf(pp, "Index: %s\n--- %s\n+++ %s\n", name, name, name);
+    else
+      fprintf(pp, "diff old/%s new/%s\n", name, name);
+    int shift = 0; // old line number - new line number
+    for (int j = 3 + r.below(8); j + 6 < c.lines; j += 7 + r.below(20)) {
+      int add = r.below(4);
+      int del = r.below(4);
+      if (!add && !del) del = 1;
+      if (c.format == 'u') {
+        fprintf(pp, "@@ -%d,%d +%d,%d @@\n", j - 2 + shift, 6 + del, j - 2, 6 + add);
+        for (int i = j - 3; i < j; i++)
+          fprintf(pp, " %s\n", lines[i].c_str());
+        for (int i = 0; i < del; i++) {
+          make_line(&r, c.style, &old);
+          fprintf(pp, "-%s\n", old.c_str());
+        }
+        for (int i = j; i < j + add; i++)
+          fprintf(pp, "+%s\n", lines[i].c_str());
+        for (int i = j + add; i < j + add + 3; i++)
+          fprintf(pp, " %s\n", lines[i].c_str());
+      } else {
+        if (del) put_range(pp, j + 1 + shift, del);
+        else fprintf(pp, "%d", j + shift);
+        fputc(add ? (del ? 'c' : 'a') : 'd', pp);
+        if (add) put_range(pp, j + 1, add);
+        else fprintf(pp, "%d", j);
+        fputc('\n', pp);
+        for (int i = 0; i < del; i++) {
+          make_line(&r, c.style, &old);
+          fprintf(pp, "< %s\n", old.c_str());
+        }
+        if (del && add) fprintf(pp, "---\n");
+        for (int i = j; i < j + add; i++)
+          fprintf(pp, "> %s\n", lines[i].c_str());
+      }
+      shift += del - add;
+      j += add;
+    }
+  }
+  if (fclose(pp)) THROW_EXCEPTION("fclose(%s) %s", patch.c_str(), strerror(errno));
+}
+
+#define BENCH_FOLD_LINES (200000)
+
+// the stages of one corpus, each timed on its own: the Reader pass, the
+// analyzer (which reads again, so parse alone is the difference), the
+// Writer folding rows of lines already in memory, and the whole render
+template <class Enc>
+static void bench_stages(const Corpus& c, const std::string& dir)
+{
+  std::string patch = dir + "/bench.patch";
+  struct stat st;
+  if (stat(patch.c_str(), &st) < 0) THROW_EXCEPTION("stat(%s) %s", patch.c_str(), strerror(errno));
+  size_t bytes = st.st_size;
+  char label[64];
+
+  double t = now();
+  Reader* reader = new Reader(patch.c_str(), c.encoding);
+  NormLine line;
+  long lines = 0;
+  std::string text;
+  std::vector<size_t> ends;
+  std::vector<int> colums;
+  while (reader->readline(&line)) {
+    lines++;
+    if (ends.size() < BENCH_FOLD_LINES) {
+      text.append(line.ptr, line.len);
+      ends.push_back(text.size());
+      colums.push_back(line.colums);
+    }
+  }
+  delete reader;
+  snprintf(label, sizeof(label), "%s/read", c.name);
+  report(label, lines, "lines", now() - t, bytes);
+
+  t = now();
+  Analyzer* analyzer = Analyzer::create(new Reader(patch.c_str(), c.encoding));
+  long hunks = 0;
+  while (analyzer->getsrc()) {
+    while (Diff* diff = analyzer->getdiff()) {
+      hunks++;
+      delete diff;
+    }
+    analyzer->arena()->clear();
+  }
+  delete analyzer;
+  snprintf(label, sizeof(label), "%s/parse", c.name);
+  report(label, hunks, "hunks", now() - t, bytes);
+
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) THROW_EXCEPTION("open() %s", strerror(errno));
+  t = now();
+  OutBuf* out = new OutBuf(fd);
+  Writer<Enc>* writer = new Writer<Enc>(DEFAULT_COLUM, out);
+  for (size_t i = 0, start = 0; i < ends.size(); start = ends[i++]) {
+    NormLine l(StrRef(text.data() + start, ends[i] - start), colums[i]);
+    writer->format(i + 1, l, i + 1, l, MODE_MOD);
+  }
+  delete writer;
+  delete out;
+  snprintf(label, sizeof(label), "%s/fold", c.name);
+  report(label, ends.size(), "lines", now() - t, text.size());
+
+  std::string cwd(PATH_MAX, 0);
+  if (!getcwd(&cwd[0], cwd.size())) THROW_EXCEPTION("getcwd() %s", strerror(errno));
+  if (chdir(dir.c_str()) < 0) THROW_EXCEPTION("chdir(%s) %s", dir.c_str(), strerror(errno));
+  t = now();
+  out = new OutBuf(fd);
+  Printer<Writer<Enc> >* printer =
+    new Printer<Writer<Enc> >(Analyzer::create(new Reader("bench.patch", c.encoding)),
+                              new Writer<Enc>(DEFAULT_COLUM, out));
+  printer->print();
+  delete printer;
+  delete out;
+  snprintf(label, sizeof(label), "%s/render", c.name);
+  report(label, c.files, "files", now() - t, bytes);
+  if (chdir(cwd.c_str()) < 0) THROW_EXCEPTION("chdir(%s) %s", cwd.c_str(), strerror(errno));
+  close(fd);
+}
+
+// every corpus below root, one directory each; kept when keep is set
+static void bench_corpora(const char* root, bool keep)
+{
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+    const Corpus& c = corpora[i];
+    std::string dir = std::string(root) + "/" + c.name;
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+      THROW_EXCEPTION("mkdir(%s) %s", dir.c_str(), strerror(errno));
+    make_corpus(c, dir, dir + "/bench.patch");
+    if (keep) {
+      printf("%s: %d files\n", dir.c_str(), c.files);
+      continue;
+    }
+    switch (c.encoding) {
+    case ENCODING_SJIS: bench_stages<EncodingSJIS>(c, dir); break;
+    case ENCODING_EUC:  bench_stages<EncodingEUC>(c, dir);  break;
+    default:            bench_stages<EncodingUTF8>(c, dir); break;
+    }
+    for (int f = 0; f < c.files; f++) {
+      char name[32];
+      snprintf(name, sizeof(name), "/f%05d.c", f);
+      unlink((dir + name).c_str());
+    }
+    unlink((dir + "/bench.patch").c_str());
+    rmdir(dir.c_str());
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* output = NULL;
+  const char* corpus_dir = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+      corpus_dir = argv[++i];
+    } else {
+      fprintf(stderr, "%s [-o results.json] [-g corpus_dir]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  try {
+    if (corpus_dir) {
+      bench_corpora(corpus_dir, true);
+      return 0;
+    }
+    bench_reader();
+    bench_writer();
+    bench_hunks();
+
+    std::string tabs, cjk, code;
+    for (int i = 0; i < 60; i++) tabs.append("\tx");
+    for (int i = 0; i < 80; i++) cjk.append("\xe6\x97\xa5"); // U+65E5
+    code = "    for (int i = 0; i < count; i++) { total += values[i] * weight; }"
+           "  // accumulate the weighted sum of all the values read so far";
+    bench_columns("columns/tab-heavy", tabs.c_str());
+    bench_columns("columns/cjk-heavy", cjk.c_str());
+    bench_columns("columns/ascii-code", code.c_str());
+
+    char dir[] = "/tmp/diffedit-corpus-XXXXXX";
+    if (!mkdtemp(dir)) THROW_EXCEPTION("mkdtemp() %s", strerror(errno));
+    bench_corpora(dir, false);
+    rmdir(dir);
+    if (output) write_results(output);
+  } catch (AppException& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -10,19 +10,58 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <algorithm>
+#include <deque>
 #include <exception>
 #include <list>
+#include <map>
+#include <new>
+#include <set>
 #include <string>
+#include <vector>
 
 #define VERSION "1.1"
 
-#define LINEBUFSIZE (256)
-#define FILENAMESIZE (128)
 #define TABSIZE (4)
 #define DEFAULT_COLUM (80)
 #define DEFAULT_READ_CACHE_SIZE (30)
+#define SOURCE_INDEX_STRIDE (64)
+#define DIFF_MAX_COST (2048)
+#define INTRA_MAX_COST (64)
+#define DIFF_BINARY_SAMPLE (64 * 1024)
+#define DIR_FILES_PER_THREAD (256)
+#define SPILL_READ_SIZE (64 * 1024)
+#define SPLIT_MIN_SIZE (1024 * 1024)
+#define SPLIT_SECTIONS_PER_THREAD (4)
+#define READ_BATCH_SIZE (64 * 1024)
+#define READ_BATCHES (16)
+#define DIFF_BATCH_SIZE (64)
+#define DIFF_BATCHES (16)
+#define SPSC_SPINS (64)
+#define WATCH_SETTLE_MSEC (100)
+#define WATCH_EVENT_BUF (64 * 1024)
 #define MODE_EQL ' '
 #define MODE_ADD 'A'
 #define MODE_MOD 'M'
@@ -32,139 +71,563 @@
 #define ENCODING_EUC     (0x01)
 #define ENCODING_SJIS    (0x02)
 #define ENCODING_UTF8    (0x04)
+#define UTF8_MAX_BYTES   (4)
+#define LNO_WIDTH        (5)
+#define LNO_MAX_WIDTH    (20)
+#define DEFAULT_OUTBUF_SIZE (1024 * 1024)
+#define JOB_OUTBUF_SIZE     (64 * 1024)
+#define JOBS_PER_THREAD     (16)
+#define RENDER_CACHE_SIZE   (256 * 1024 * 1024)
+#define DETECT_SAMPLE_SIZE  (256 * 1024)
+#define DETECT_SOURCE_SIZE  (64 * 1024)
+#define DETECT_SOURCE_FILES (16)
 
-int strcolumlen(char* in);
-void cutLF(char* buf)
+// non-owning view of a line; not NUL terminated
+struct StrRef
 {
-  char* p;
-  if (p = strchr(buf, '\r')) *p = 0;
-  if (p = strchr(buf, '\n')) *p = 0;
+  StrRef() : ptr(NULL), len(0) {}
+  StrRef(const char* p, size_t n) : ptr(p), len(n) {}
+  char at(size_t i) const { return i < len ? ptr[i] : 0; }
+  StrRef sub(size_t off) const {
+    if (off > len) off = len;
+    return StrRef(ptr + off, len - off);
+  }
+  const char* ptr;
+  size_t len;
+};
+
+size_t cutLF(const char* buf, size_t len)
+{
+  const char* p;
+  if ((p = (const char*)memchr(buf, '\r', len))) len = p - buf;
+  if ((p = (const char*)memchr(buf, '\n', len))) len = p - buf;
+  return len;
+}
+
+StrRef trimspace(StrRef in)
+{
+  const char* sp = in.ptr;
+  const char* ep = in.ptr + in.len;
+  while (sp != ep) {
+    if (*sp != ' ' && *sp != '\t') break;
+    sp++;
+  }
+  while (sp != ep) {
+    if (*(ep-1) != ' ' && *(ep-1) != '\t') break;
+    ep--;
+  }
+  return StrRef(sp, ep - sp);
+}
+
+// line numbers and counts of lines; files may run past 2^31 lines
+typedef int64_t lno_t;
+
+// atoll() over a view
+lno_t strtolno(const char* p, const char* end)
+{
+  lno_t sign = 1, val = 0;
+  while (p != end && (*p == ' ' || *p == '\t')) p++;
+  if (p != end && (*p == '-' || *p == '+')) {
+    if (*p == '-') sign = -1;
+    p++;
+  }
+  for (; p != end && '0' <= *p && *p <= '9'; p++)
+    val = val * 10 + (*p - '0');
+  return sign * val;
+}
+
+// byte_class[] bits (see mkwidth.cxx)
+#define BC_UTF8_LEN   (0x07)
+#define BC_UTF8_TRAIL (0x08)
+#define BC_SJIS_LEAD  (0x10)
+#define BC_SJIS_TRAIL (0x20)
+#define BC_EUC        (0x40)
+#define BC_KANA       (0x80)
+
+#include "widthtab.h"
+
+// display width of a code point: one lookup in the generated two-stage table
+inline int ucs_width(uint32_t cp)
+{
+  if (cp >= 0x110000) return 1;
+  unsigned char b = ucs_width_block[ucs_width_index[cp >> UCS_WIDTH_BLOCK_BITS]]
+                                   [(cp & ((1 << UCS_WIDTH_BLOCK_BITS) - 1)) >> 2];
+  return (b >> ((cp & 3) * 2)) & 3;
+}
+
+#define UTF8_TRAIL(c) (((c) & 0xC0) == 0x80)
+
+// length of the UTF-8 sequence at in, 0 if it is not a valid one;
+// overlong forms, surrogates and code points past U+10FFFF are not
+inline int utf8_decode(const unsigned char* in, size_t rest, uint32_t* cp)
+{
+  switch (byte_class[*in] & BC_UTF8_LEN) {
+  case 2:
+    if (rest < 2 || !UTF8_TRAIL(in[1])) return 0;
+    *cp = ((in[0] & 0x1F) << 6) | (in[1] & 0x3F);
+    return 2;
+  case 3:
+    if (rest < 3 || !UTF8_TRAIL(in[1]) || !UTF8_TRAIL(in[2])) return 0;
+    *cp = ((in[0] & 0x0F) << 12) | ((in[1] & 0x3F) << 6) | (in[2] & 0x3F);
+    if (*cp < 0x800 || (0xD800 <= *cp && *cp <= 0xDFFF)) return 0;
+    return 3;
+  case 4:
+    if (rest < 4 || !UTF8_TRAIL(in[1]) || !UTF8_TRAIL(in[2]) ||
+        !UTF8_TRAIL(in[3])) return 0;
+    *cp = ((in[0] & 0x07) << 18) | ((in[1] & 0x3F) << 12) |
+          ((in[2] & 0x3F) << 6) | (in[3] & 0x3F);
+    if (*cp < 0x10000 || *cp > 0x10FFFF) return 0;
+    return 4;
+  }
+  return 0;
+}
+
+inline bool sjis_zenkaku(const unsigned char* in, size_t rest)
+{
+  return rest >= 2 && (byte_class[in[0]] & BC_SJIS_LEAD) &&
+                      (byte_class[in[1]] & BC_SJIS_TRAIL);
+}
+
+inline bool euc_zenkaku(const unsigned char* in, size_t rest)
+{
+  return rest >= 2 && (byte_class[in[0]] & byte_class[in[1]] & BC_EUC);
+}
+
+inline bool euc_hankana(const unsigned char* in, size_t rest)
+{
+  return rest >= 2 && in[0] == 0x8E && (byte_class[in[1]] & BC_KANA);
 }
 
-void expandTAB(char* buf)
+// encoding policies: getcolumsz() gives the size and display width of the
+// non-ASCII character at in; bytes that do not start a valid sequence
+// within rest count as one column each
+struct EncodingAuto
+{
+  enum { id = ENCODING_UNKNOWN };
+  static inline void getcolumsz(const unsigned char* in, size_t rest,
+                                int* sz, int* col) {
+    uint32_t cp;
+    if ((*sz = utf8_decode(in, rest, &cp))) {
+      *col = ucs_width(cp);
+    } else if (sjis_zenkaku(in, rest) || euc_zenkaku(in, rest)) {
+      *sz = 2;
+      *col = 2;
+    } else if (euc_hankana(in, rest)) {
+      *sz = 2;
+      *col = 1;
+    } else {
+      *sz = 1;
+      *col = 1;
+    }
+  }
+};
+
+struct EncodingUTF8
+{
+  enum { id = ENCODING_UTF8 };
+  static inline void getcolumsz(const unsigned char* in, size_t rest,
+                                int* sz, int* col) {
+    uint32_t cp;
+    if ((*sz = utf8_decode(in, rest, &cp))) {
+      *col = ucs_width(cp);
+    } else {
+      *sz = 1;
+      *col = 1;
+    }
+  }
+};
+
+struct EncodingSJIS
 {
-  char tmp[LINEBUFSIZE];
-  memset(tmp, 0, sizeof(tmp));
-  char* src = buf;
-  char* dst = tmp;
+  enum { id = ENCODING_SJIS };
+  static inline void getcolumsz(const unsigned char* in, size_t rest,
+                                int* sz, int* col) {
+    *sz = *col = sjis_zenkaku(in, rest) ? 2 : 1;
+  }
+};
 
-  while(*src) {
-    if (*src == '\t') {
-      int n_sp = TABSIZE - (strcolumlen(tmp) % TABSIZE); // 20110730 added
-      memset(dst, ' ', n_sp);
-      dst += n_sp;
+struct EncodingEUC
+{
+  enum { id = ENCODING_EUC };
+  static inline void getcolumsz(const unsigned char* in, size_t rest,
+                                int* sz, int* col) {
+    if (euc_hankana(in, rest)) {
+      *sz = 2;
+      *col = 1;
+    } else if (in[0] == 0x8F && euc_zenkaku(in + 1, rest - 1)) { // JIS X 0212
+      *sz = 3;
+      *col = 2;
+    } else if (euc_zenkaku(in, rest)) {
+      *sz = 2;
+      *col = 2;
     } else {
-      *dst = *src;
-      dst++;
+      *sz = 1;
+      *col = 1;
     }
-    src++;
   }
-  strcpy(buf, tmp);
+};
+
+// length of the leading run of ASCII bytes in p[0..n)
+size_t ascii_span_scalar(const unsigned char* p, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    if (v & 0x8080808080808080ULL) break;
+  }
+  for (; i < n; i++)
+    if (p[i] & 0x80) break;
+  return i;
 }
 
-void trimspace(char* buf)
+#ifdef __SSE2__
+size_t ascii_span_sse2(const unsigned char* p, size_t n)
 {
-  char* sp = buf;
-  char* ep = buf + strlen(buf)-1;
-  while(*sp) {
-    if (*sp != ' ' && *sp != '\t') break;
-    sp++;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+    if (mask) return i + __builtin_ctz(mask);
   }
-  while(sp != ep) {
-    if (*ep != ' ' && *ep != '\t') break;
-    ep--;
+  return i + ascii_span_scalar(p + i, n - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t ascii_span_avx2(const unsigned char* p, size_t n)
+{
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(p + i)));
+    if (mask) return i + __builtin_ctz(mask);
   }
-  ep++;
-  while(sp != ep)
-    *buf++ = *sp++;
-  *buf = 0;
+  return i + ascii_span_scalar(p + i, n - i);
 }
+#endif
 
-bool is_ascii(unsigned char c)
+typedef size_t (*ascii_span_t)(const unsigned char* p, size_t n);
+const char* simd_path = "scalar";
+
+ascii_span_t select_ascii_span()
 {
-  if (0x00 <= c && c <= 0x7F)
-    return true;
-  return false;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    simd_path = "avx2";
+    return ascii_span_avx2;
+  }
+#endif
+#ifdef __SSE2__
+  simd_path = "sse2";
+  return ascii_span_sse2;
+#endif
+  return ascii_span_scalar;
 }
 
-bool is_sjis_hankana(unsigned char c)
+// chosen once for the CPU we run on
+ascii_span_t ascii_span = select_ascii_span();
+
+// display width of str; ASCII runs are counted a vector at a time and
+// only multibyte sequences go through Enc::getcolumsz()
+template <class Enc>
+int columlen(StrRef str)
 {
-  if (0xA1 <= c && c <= 0xDF)
-    return true;
-  return false;
+  int sz, col;
+  int colsum = 0;
+  const unsigned char* in = (const unsigned char*)str.ptr;
+  const unsigned char* end = in + str.len;
+  while (in != end) {
+    size_t n = ascii_span(in, end - in);
+    in += n;
+    colsum += n;
+    while (in != end && (*in & 0x80)) {
+      Enc::getcolumsz(in, end - in, &sz, &col);
+      in += sz;
+      colsum += col;
+    }
+  }
+  return colsum;
 }
 
-bool is_sjis_zenkaku(unsigned char* c)
+// the expanded line is built in out only when in contains a TAB;
+// colums gets the display width of the result, measured in the same pass
+template <class Enc>
+StrRef expandTAB(StrRef in, std::string* out, int* colums)
 {
-  if ((0x81 <= *c && *c <= 0x9F) || (0xE0 <= *c && *c <= 0xFC))
-    if ((0x40 <= *(c+1) && *(c+1) <= 0x7E) || (0x80 <= *(c+1) && *(c+1) <= 0xFC))
-      return true;
-  return false;
+  const char* tab = (const char*)memchr(in.ptr, '\t', in.len);
+  if (!tab) {
+    *colums = columlen<Enc>(in);
+    return in;
+  }
+
+  const char* src = in.ptr;
+  const char* end = in.ptr + in.len;
+  int col = 0;
+  out->clear();
+  while (tab) {
+    out->append(src, tab - src);
+    col += columlen<Enc>(StrRef(src, tab - src));
+    int n_sp = TABSIZE - (col % TABSIZE); // 20110730 added
+    out->append(n_sp, ' ');
+    col += n_sp;
+    src = tab + 1;
+    tab = (const char*)memchr(src, '\t', end - src);
+  }
+  out->append(src, end - src);
+  *colums = col + columlen<Enc>(StrRef(src, end - src));
+  return StrRef(out->data(), out->size());
 }
 
-bool is_euc_hankana(unsigned char* c)
+// pipeline stages, timed by --stats
+#define STAGE_OTHER (0)
+#define STAGE_READ  (1)
+#define STAGE_PARSE (2)
+#define STAGE_EQUAL (3)
+#define STAGE_FOLD  (4)
+#define STAGE_WRITE (5)
+#define STAGES      (6)
+#define STATS_SAMPLE_USEC (1000)
+#define TRACE_MAX_EVENTS  (4 * 1024 * 1024)
+
+// pipeline counters, reported by --stats
+struct Stats
 {
-  if (*c == 0x8E)
-    if (0xA1 <= *(c+1) && *(c+1) <= 0xDF)
-      return true;
-  return false;
+  long readers;
+  long reader_bytes;
+  long reader_lines;
+  long reader_normalized;
+  long source_lines;
+  long source_normalized;
+  long writer_rows;
+  long fold_measured;
+  long fold_scanned;
+  long spill_bytes;
+  long skipped_lines;
+  long intra_rows;
+  long intra_capped;
+  long hunks;
+  long files;
+  long out_bytes;
+  long allocations;
+  long render_hits;
+  long render_misses;
+  long render_evicted;
+  int stage;                     // the stage the thread is in
+  uint64_t stage_since;          // ticks() when it was entered
+  uint64_t stage_ticks[STAGES];  // time spent in each stage
+  long stage_samples[STAGES];    // SIGPROF samples taken in each stage
+  int encoding;
+  const char* encoding_by;
+  long detect_bytes;
+  double detect_msec;
+};
+// counted per thread; render workers hand theirs to main when joined
+static __thread Stats stats;
+
+void add_stats(const Stats& from)
+{
+  stats.reader_lines += from.reader_lines;
+  stats.reader_normalized += from.reader_normalized;
+  stats.source_lines += from.source_lines;
+  stats.source_normalized += from.source_normalized;
+  stats.writer_rows += from.writer_rows;
+  stats.fold_measured += from.fold_measured;
+  stats.fold_scanned += from.fold_scanned;
+  stats.spill_bytes += from.spill_bytes;
+  stats.skipped_lines += from.skipped_lines;
+  stats.intra_rows += from.intra_rows;
+  stats.intra_capped += from.intra_capped;
+  stats.readers += from.readers;
+  stats.reader_bytes += from.reader_bytes;
+  stats.hunks += from.hunks;
+  stats.files += from.files;
+  stats.out_bytes += from.out_bytes;
+  stats.allocations += from.allocations;
+  stats.render_hits += from.render_hits;
+  stats.render_misses += from.render_misses;
+  stats.render_evicted += from.render_evicted;
+  for (int i = 0; i < STAGES; i++) {
+    stats.stage_ticks[i] += from.stage_ticks[i];
+    stats.stage_samples[i] += from.stage_samples[i];
+  }
 }
 
-bool is_euc_zenkaku(unsigned char* c)
+// set once by --stats before any work starts; without it a stage switch
+// is a test of this flag and nothing more
+static bool stats_enabled;
+
+// a cheap timestamp for stage switches: the TSC on x86, else the
+// monotonic clock in ns; print_stats() scales ticks to the clock
+inline uint64_t ticks()
 {
-  if (0xA1 <= *c || *c <= 0xFE)
-    if (0xA1 <= *c || *c <= 0xFE)
-      return true;
-  return false;
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
-bool is_utf8_2byte(unsigned char* c)
+// moves the thread to stage s, charging the time since the last switch
+// to the stage it leaves; returns that stage
+inline int enter_stage(int s)
 {
-  if (0xC2 <= *c && *c <= 0xDF)
-    if (0x80 <= *(c+1) && *(c+1) <= 0xBF)
-      return true;
-  return false;
+  int prev = stats.stage;
+  uint64_t now = ticks();
+  if (stats.stage_since)
+    stats.stage_ticks[prev] += now - stats.stage_since;
+  stats.stage_since = now;
+  stats.stage = s;
+  return prev;
 }
 
-bool is_utf8_3byte(unsigned char* c)
+// the enclosing scope runs in stage s; nested stages are timed apart
+class Stage
 {
-  if (0xE0 <= *c && *c <= 0xEF)
-    if (0x80 <= *(c+1) && *(c+1) <= 0xBF)
-      if (0x80 <= *(c+2) && *(c+2) <= 0xBF)
-        return true;
-  return false;
+public:
+  Stage(int s) {
+    if (stats_enabled) prev_ = enter_stage(s);
+  }
+  ~Stage() {
+    if (stats_enabled) enter_stage(prev_);
+  }
+private:
+  int prev_;
+};
+
+// ticks() against the monotonic clock, from start() on
+struct TickClock
+{
+  void start() {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ticks0 = ticks();
+  }
+  double msec() {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  }
+  double msec_per_tick() { return msec() / (ticks() - ticks0); }
+  struct timespec t0;
+  uint64_t ticks0;
+};
+static TickClock tick_clock;
+
+// one span of --trace, tagged with the file its thread was on
+struct TraceEvent
+{
+  const char* name;
+  uint64_t begin;
+  uint64_t end;
+  int file; // index into the thread's files, -1 for none
+};
+
+// the spans of one thread.  Only that thread appends to it, and the
+// buffers are linked into trace_threads with a CAS, so recording a span
+// takes no lock; they are read once all the threads are joined
+struct TraceBuffer
+{
+  TraceBuffer* next;
+  long tid;
+  const char* thread;
+  long dropped; // spans past TRACE_MAX_EVENTS
+  std::vector<TraceEvent> events;
+  std::vector<std::string> files;
+};
+static bool trace_enabled;
+static TraceBuffer* trace_threads;
+static __thread TraceBuffer* trace_buffer;
+
+// this thread's buffer, made on first use; name labels the thread
+TraceBuffer* trace_thread(const char* name = NULL)
+{
+  if (!trace_buffer) {
+    TraceBuffer* buffer = new TraceBuffer;
+    buffer->tid = syscall(SYS_gettid);
+    buffer->thread = "thread";
+    buffer->dropped = 0;
+    buffer->next = __atomic_load_n(&trace_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_threads, &buffer->next, buffer, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    trace_buffer = buffer;
+  }
+  if (name) trace_buffer->thread = name;
+  return trace_buffer;
 }
 
-// 20110730 added
-int strcolumlen(char* str)
+// the file the following spans of this thread belong to
+inline void trace_file(const char* filename)
 {
-  int col = 0;
-  int max = strlen(str);
-  unsigned char* in = (unsigned char*)str;
-  for (int i = 0; i < max;) {
-    if (is_ascii(in[i])) {
-      i += 1;
-      col += 1;
-    } else if (is_utf8_3byte(&in[i])) {
-      i += 3;
-      col += 2;
-    } else if (is_utf8_2byte(&in[i])  ||
-               is_euc_zenkaku(&in[i]) ||
-               is_sjis_zenkaku(&in[i])) {
-      i += 2;
-      col += 2;
-    } else if (is_euc_hankana(&in[i])) {
-      i += 2;
-      col += 1;
-    } else if (is_sjis_hankana(in[i])) {
-      i += 1;
-      col += 1;
-    } else {
-      i += 1;
-      col += 1;
+  if (trace_enabled)
+    trace_thread()->files.push_back(filename);
+}
+
+// the enclosing scope as a span of --trace; without it a test of the flag
+class Span
+{
+public:
+  Span(const char* name) : name_(name) {
+    if (trace_enabled) begin_ = ticks();
+  }
+  ~Span() {
+    if (trace_enabled) record();
+  }
+private:
+  void record() {
+    TraceBuffer* buffer = trace_thread();
+    if (buffer->events.size() >= TRACE_MAX_EVENTS) {
+      buffer->dropped++;
+      return;
     }
+    TraceEvent event = { name_, begin_, ticks(), (int)buffer->files.size() - 1 };
+    buffer->events.push_back(event);
+  }
+  const char* name_;
+  uint64_t begin_;
+};
+
+// a line after the normalize stage: LF cut, TABs expanded and measured
+struct NormLine : public StrRef
+{
+  NormLine() : stripped(0), colums(-1) {}
+  NormLine(StrRef text, int col) : StrRef(text), stripped(text.len), colums(col) {}
+  // drops a leading ASCII marker such as "+", "-" or "< "
+  NormLine tail(size_t off) const {
+    NormLine line(*this);
+    if (off > len) off = len;
+    line.ptr += off;
+    line.len -= off;
+    if (line.colums >= 0) line.colums -= off;
+    return line;
+  }
+  size_t stripped; // raw length without LF, before TAB expansion
+  int colums;      // display width of the text, -1 when unknown
+};
+
+// the normalize stage; every line read is passed through here exactly once
+template <class Enc>
+NormLine normalize(const char* raw, size_t len, std::string* buf)
+{
+  NormLine line;
+  line.stripped = cutLF(raw, len);
+  StrRef text = expandTAB<Enc>(StrRef(raw, line.stripped), buf, &line.colums);
+  line.ptr = text.ptr;
+  line.len = text.len;
+  return line;
+}
+
+typedef NormLine (*normalize_t)(const char* raw, size_t len, std::string* buf);
+
+normalize_t normalizer(int encoding)
+{
+  switch (encoding) {
+  case ENCODING_UTF8: return normalize<EncodingUTF8>;
+  case ENCODING_SJIS: return normalize<EncodingSJIS>;
+  case ENCODING_EUC:  return normalize<EncodingEUC>;
   }
-  return col;
+  return normalize<EncodingAuto>;
 }
 
 #define THROW_EXCEPTION(format, args...)                        \
@@ -190,51 +653,172 @@ private:
   char message_[128];
 };
 
+// a bounded queue from one producer thread to one consumer thread.  Each
+// side writes only its own index, so push and pop take no lock; a side
+// that finds the queue full or empty spins a little, then sleeps in a
+// futex on the other side's index until it moves
+template <class T>
+class SpscQueue
+{
+public:
+  SpscQueue(size_t size) : head_(0), tail_(0), sleepers_(0) {
+    size_t n = 1;
+    while (n < size) n <<= 1;
+    slots_.resize(n);
+    mask_ = n - 1;
+  }
+  void push(T* item) {
+    uint32_t tail = tail_;
+    uint32_t head;
+    while (tail - (head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE)) > mask_)
+      wait(&head_, head);
+    slots_[tail & mask_] = item;
+    __atomic_store_n(&tail_, tail + 1, __ATOMIC_SEQ_CST);
+    wake(&tail_);
+  }
+  T* pop() {
+    uint32_t head = head_;
+    uint32_t tail;
+    while ((tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE)) == head)
+      wait(&tail_, tail);
+    T* item = slots_[head & mask_];
+    __atomic_store_n(&head_, head + 1, __ATOMIC_SEQ_CST);
+    wake(&head_);
+    return item;
+  }
+private:
+  // while the other side's index is still seen.  The sleeper counts
+  // itself before its last look and the other side looks at the count
+  // after it moved, and FUTEX_WAIT gives up if the index is no longer
+  // seen, so a wakeup cannot fall between the two
+  void wait(uint32_t* index, uint32_t seen) {
+    for (int i = 0; i < SPSC_SPINS; i++) {
+      if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != seen)
+        return;
+      sched_yield();
+    }
+    __atomic_add_fetch(&sleepers_, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen)
+      syscall(SYS_futex, index, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&sleepers_, 1, __ATOMIC_SEQ_CST);
+  }
+  void wake(uint32_t* index) {
+    if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, index, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+  std::vector<T*> slots_;
+  uint32_t mask_;
+  uint32_t head_ __attribute__((aligned(64))); // next to pop, the consumer's
+  uint32_t tail_ __attribute__((aligned(64))); // next to push, the producer's
+  int sleepers_ __attribute__((aligned(64)));
+};
+
 class Reader
 {
 public:
-  Reader(FILE* fp = stdin, int cachesize = DEFAULT_READ_CACHE_SIZE)
-    : fp_(fp), isSelfOpened_(false), cachesize_(cachesize), c_pos_(-1) {
+  // with ahead, the input is read on a thread of its own
+  Reader(FILE* fp = stdin, int encoding = ENCODING_UNKNOWN,
+         int cachesize = DEFAULT_READ_CACHE_SIZE, bool ahead = false)
+    : fp_(fp), isSelfOpened_(false), normalize_(normalizer(encoding)),
+      cachesize_(cachesize), c_pos_(-1), ahead_(NULL) {
+    if (ahead) start_ahead();
     init();
   }
-  Reader(const char* filename, int cachesize = DEFAULT_READ_CACHE_SIZE)
-    : isSelfOpened_(true), cachesize_(cachesize), c_pos_(-1) {
+  Reader(const char* filename, int encoding = ENCODING_UNKNOWN,
+         int cachesize = DEFAULT_READ_CACHE_SIZE, bool ahead = false)
+    : isSelfOpened_(true), normalize_(normalizer(encoding)),
+      cachesize_(cachesize), c_pos_(-1), ahead_(NULL) {
     if (!(fp_ = fopen(filename, "r")))
       THROW_EXCEPTION("fopen(%s) %s", filename, strerror(errno));
+    if (ahead) start_ahead();
     init();
   }
   ~Reader() {
-    clear_cache();
+    if (ahead_) stop_ahead();
+    for (size_t i = 0; i < slots_.size(); i++)
+      free(slots_[i].buf);
     if (fp_ && isSelfOpened_) fclose(fp_);
   }
-  char* readline();
+  bool readline(NormLine* line);
   void reset() { c_pos_ = -1; }
   void forward();
   void rewind();
-  char* prev() { return getstr(c_pos_ - 1); }
-  char* crnt() { return getstr(c_pos_); }
-  char* next() { return getstr(c_pos_ + 1); }
+  NormLine prev() { return getstr(c_pos_ - 1); }
+  NormLine crnt() { return getstr(c_pos_); }
+  NormLine next() { return getstr(c_pos_ + 1); }
+  NormLine body(size_t off);
   int cachesize() { return cachesize_; }
+  void set_encoding(int encoding) { normalize_ = normalizer(encoding); }
+  StrRef raw(int pos);
 
 private:
-  void clear_cache();
+  // one line of the lookahead window; buf is reused by getline()
+  struct Slot
+  {
+    Slot() : buf(NULL), cap(0), len(0), normalized(false) {}
+    char* buf;
+    size_t cap;
+    size_t len;
+    std::string expanded;
+    NormLine norm;
+    bool normalized; // norm is filled on first access
+  };
+  // the input as read() by the reader thread, up to READ_BATCHES of
+  // READ_BATCH_SIZE bytes ahead of the parser; realread() cuts them into
+  // lines and hands each one back through free.  A batch of 0 bytes is
+  // the end of the input
+  struct Batch
+  {
+    char data[READ_BATCH_SIZE];
+    size_t len;
+  };
+  struct ReadAhead
+  {
+    ReadAhead(int fd) : fd(fd), stop_fd(-1), stop(false), full(READ_BATCHES),
+                        free(READ_BATCHES + 1), batch(NULL), pos(0), eof(false) {
+      memset(&stats, 0, sizeof(stats));
+    }
+    int fd;
+    int stop_fd;  // an eventfd that wakes the thread out of poll()
+    bool stop;    // set by stop_ahead(), looked at between batches
+    pthread_t thread;
+    SpscQueue<Batch> full;
+    SpscQueue<Batch> free;
+    std::vector<Batch*> batches;
+    Batch* batch; // being cut into lines
+    size_t pos;
+    bool eof;
+    Stats stats;  // the reader thread's, once it ends
+  };
   void init();
-  char* getstr(int pos);
-  char* realread();
-  char* normalize(const char* line);
+  NormLine getstr(int pos);
+  bool realread(Slot* slot);
+  void start_ahead();
+  void stop_ahead();
+  static void* read_main(void* arg);
+  static ssize_t read_batch(ReadAhead* ahead, Batch* batch);
+  ssize_t take_line(Slot* slot);
   FILE* fp_;
   bool isSelfOpened_;
+  normalize_t normalize_;
   int cachesize_;
   int c_pos_;
-  std::list<std::string*> cache_;
+  std::string body_; // the expanded text of the last body()
+  // lookahead window: a ring of reusable line slots, oldest line at head_
+  std::vector<Slot> slots_;
+  int head_;
+  int count_;
+  ReadAhead* ahead_;
 };
 
 void Reader::init()
 {
+  stats.readers++;
+  slots_.resize(cachesize_ + 1);
+  head_ = count_ = 0;
   for (int i = 0; i < cachesize_ + 1; i++) {
-    char* line = realread();
-    if (line)
-      cache_.push_back(new std::string(line));
+    if (realread(&slots_[i]))
+      count_++;
     else {
       if (i == 0) THROW_EXCEPTION("initialize  error");
       cachesize_ = i - 1;
@@ -244,52 +828,196 @@ void Reader::init()
   c_pos_ = -1;
 }
 
-char* Reader::getstr(int pos)
+NormLine Reader::getstr(int pos)
 {
-  static char line[LINEBUFSIZE];
-
-  if (pos < 0)
-    return NULL;
+  if (pos < 0 || pos >= count_)
+    return NormLine();
 
-  int i = 0;
-  for (std::list<std::string*>::iterator it = cache_.begin();
-       it != cache_.end(); it++, i++) {
-    if (i == pos)
-      return normalize((*it)->c_str());
+  int i = head_ + pos;
+  if (i >= (int)slots_.size()) i -= slots_.size();
+  Slot* slot = &slots_[i];
+  if (!slot->normalized) {
+    Stage stage(STAGE_READ);
+    slot->norm = normalize_(slot->buf, slot->len, &slot->expanded);
+    slot->normalized = true;
+    stats.reader_normalized++;
   }
-  return NULL;
+  return slot->norm;
+}
+
+// the line at pos as read, before normalization
+StrRef Reader::raw(int pos)
+{
+  if (pos < 0 || pos >= count_)
+    return StrRef();
+
+  int i = head_ + pos;
+  if (i >= (int)slots_.size()) i -= slots_.size();
+  return StrRef(slots_[i].buf, slots_[i].len);
+}
+
+// the current line without a marker of off bytes such as "+" or "< ";
+// its TABs are expanded from the first column after the marker, as
+// they are in the source file
+NormLine Reader::body(size_t off)
+{
+  NormLine line = crnt();
+  StrRef text = raw(c_pos_);
+  if (line.ptr == text.ptr || off > line.stripped)
+    return line.tail(off); // no TAB
+  Stage stage(STAGE_READ);
+  return normalize_(text.ptr + off, text.len - off, &body_);
 }
 
-char* Reader::readline()
+bool Reader::readline(NormLine* line)
 {
   forward();
-  return crnt();
+  *line = crnt();
+  return line->ptr != NULL;
 }
 
-void Reader::clear_cache()
+bool Reader::realread(Slot* slot)
 {
-  for (std::list<std::string*>::iterator it = cache_.begin();
-       it != cache_.end(); it++)
-    delete *it;
-  cache_.clear();
+  Stage stage(STAGE_READ);
+  ssize_t n = ahead_ ? take_line(slot) : getline(&slot->buf, &slot->cap, fp_);
+  if (n < 0)
+    return false;
+  slot->len = n;
+  slot->normalized = false;
+  stats.reader_lines++;
+  stats.reader_bytes += n;
+  return true;
 }
 
-char* Reader::realread()
+// the next line out of the read-ahead batches, -1 at the end of input
+ssize_t Reader::take_line(Slot* slot)
 {
-  static char line[LINEBUFSIZE];
-  if (!fgets(line, sizeof(line)-1, fp_))
-    return NULL;
-  return line;
+  ReadAhead* ahead = ahead_;
+  size_t len = 0;
+  while (!ahead->eof) {
+    if (!ahead->batch) {
+      Batch* batch = ahead->full.pop();
+      if (!batch->len) {
+        ahead->eof = true;
+        break;
+      }
+      ahead->batch = batch;
+      ahead->pos = 0;
+    }
+    Batch* batch = ahead->batch;
+    const char* p = batch->data + ahead->pos;
+    size_t rest = batch->len - ahead->pos;
+    const char* lf = (const char*)memchr(p, '\n', rest);
+    size_t n = lf ? lf - p + 1 : rest;
+    if (len + n + 1 > slot->cap) {
+      size_t cap = std::max(len + n + 1, slot->cap * 2);
+      char* buf = (char*)realloc(slot->buf, cap);
+      if (!buf) THROW_EXCEPTION("realloc() failed");
+      slot->buf = buf;
+      slot->cap = cap;
+    }
+    memcpy(slot->buf + len, p, n);
+    len += n;
+    ahead->pos += n;
+    if (ahead->pos == batch->len) {
+      ahead->batch = NULL;
+      ahead->free.push(batch);
+    }
+    if (lf) break;
+  }
+  if (!len)
+    return -1;
+  slot->buf[len] = '\0';
+  return len;
+}
+
+// without a thread the Reader falls back to getline()
+void Reader::start_ahead()
+{
+  ReadAhead* ahead = new ReadAhead(fileno(fp_));
+  for (int i = 0; i < READ_BATCHES; i++) {
+    ahead->batches.push_back(new Batch);
+    ahead->free.push(ahead->batches.back());
+  }
+  if ((ahead->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+      pthread_create(&ahead->thread, NULL, read_main, ahead)) {
+    if (ahead->stop_fd >= 0) close(ahead->stop_fd);
+    for (size_t i = 0; i < ahead->batches.size(); i++)
+      delete ahead->batches[i];
+    delete ahead;
+    return;
+  }
+  ahead_ = ahead;
+}
+
+// before the end of input the thread may be waiting for a free batch or
+// for input; the NULL batch and the eventfd end either wait
+void Reader::stop_ahead()
+{
+  __atomic_store_n(&ahead_->stop, true, __ATOMIC_RELEASE);
+  eventfd_write(ahead_->stop_fd, 1);
+  ahead_->free.push(NULL);
+  pthread_join(ahead_->thread, NULL);
+  add_stats(ahead_->stats);
+  close(ahead_->stop_fd);
+  for (size_t i = 0; i < ahead_->batches.size(); i++)
+    delete ahead_->batches[i];
+  delete ahead_;
+  ahead_ = NULL;
+}
+
+// one read() into batch, 0 at the end of input or once stop_ahead() is called
+ssize_t Reader::read_batch(ReadAhead* ahead, Batch* batch)
+{
+  struct pollfd fds[2];
+  fds[0].fd = ahead->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = ahead->stop_fd;
+  fds[1].events = POLLIN;
+  while (!__atomic_load_n(&ahead->stop, __ATOMIC_ACQUIRE)) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+    } else if (fds[1].revents) {
+      break;
+    }
+    ssize_t n = read(ahead->fd, batch->data, READ_BATCH_SIZE);
+    if (n >= 0 || errno != EINTR)
+      return n;
+  }
+  return 0;
+}
+
+void* Reader::read_main(void* arg)
+{
+  ReadAhead* ahead = (ReadAhead*)arg;
+  if (trace_enabled) trace_thread("reader");
+  while (Batch* batch = ahead->free.pop()) {
+    ssize_t n;
+    {
+      Stage stage(STAGE_READ);
+      Span span("read");
+      n = read_batch(ahead, batch);
+    }
+    // a read error ends the input, as it did for getline()
+    batch->len = n > 0 ? n : 0;
+    ahead->full.push(batch);
+    if (n <= 0) break;
+  }
+  ahead->stats = stats;
+  return NULL;
 }
 
 void Reader::forward()
 {
   if (c_pos_ == cachesize_ - 1) {
-    delete cache_.front();
-    cache_.pop_front();
-    char* line = realread();
-    if (line)
-      cache_.push_back(new std::string(line));
+    // drop the oldest line and refill the freed slot at the tail
+    if (!count_) return;
+    if (++head_ == (int)slots_.size()) head_ = 0;
+    count_--;
+    int tail = head_ + count_;
+    if (tail >= (int)slots_.size()) tail -= slots_.size();
+    if (realread(&slots_[tail]))
+      count_++;
   } else {
     c_pos_++;
   }
@@ -302,104 +1030,417 @@ void Reader::rewind()
   c_pos_--;
 }
 
-char* Reader::normalize(const char* buf)
+// maps a whole file read-only; NULL for an empty file
+const char* map_file(const char* filename, size_t* size)
 {
-  static char line[LINEBUFSIZE];
-  strncpy(line, buf, sizeof(line)-1);
-  cutLF(line);
-  expandTAB(line);
-  return line;
+  int fd;
+  struct stat st;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    THROW_EXCEPTION("open(%s) %s", filename, strerror(errno));
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    THROW_EXCEPTION("fstat(%s) %s", filename, strerror(errno));
+  }
+  *size = st.st_size;
+  void* p = NULL;
+  if (*size > 0) {
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      THROW_EXCEPTION("mmap(%s) %s", filename, strerror(errno));
+    }
+    madvise(p, *size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return (const char*)p;
 }
 
-class Line
+// read-only view of a source file: mapped once, lines located through a
+// sparse line-offset index that is extended on demand
+class Source
 {
 public:
-  Line() : start_(0), end_(0) {}
-  Line(int start, int end) : start_(start), end_(end) {}
-  ~Line() {
-    for (std::list<std::string*>::iterator it = strs_.begin();
-         it != strs_.end(); it++)
-      delete *it;
-  }
-  void set_start(int start) { start_ = start; }
-  void set_end(int end) { end_ = end; }
-  int start() { return start_; }
-  int end() { return end_; }
-  void addstr(char* str) {
-    strs_.push_back(new std::string(str));
-  }
-  void debug() {
-    fprintf(stderr, "start[%5d] end[%5d]\n", start_, end_);
-    for (std::list<std::string*>::iterator it = strs_.begin();
-         it != strs_.end(); it++)
-      fprintf(stderr, "[%s]\n", (*it)->c_str());
+  Source(const char* filename, int encoding);
+  ~Source() {
+    if (map_) munmap((void*)map_, size_);
   }
-  std::string* getstr() {
-    if (!strs_.empty()) {
-      std::string* p = strs_.front();
-      strs_.pop_front();
-      return p;
-    }
-    return NULL;
+  bool readline(NormLine* line);
+  void seek(lno_t lno);
+  void skip(lno_t lines) { seek(pos_ + lines); }
+  lno_t skip_rest();
+  // the lines of the file, counted no further than max
+  lno_t lines(lno_t max = LLONG_MAX) {
+    index_to(max);
+    return scanned_lno_;
   }
+  // no file has more lines than bytes
+  size_t size() { return size_; }
+
 private:
-  int start_;
-  int end_;
-  std::list<std::string*> strs_;
+  bool index_to(lno_t lno);
+  normalize_t normalize_;
+  const char* map_;
+  size_t size_;
+  std::vector<size_t> index_; // offset of line i * SOURCE_INDEX_STRIDE
+  size_t scanned_;            // offset of line scanned_lno_
+  lno_t scanned_lno_;
+  size_t off_;                // offset of line pos_
+  lno_t pos_;                 // lines consumed so far
+  std::string expanded_;
 };
 
-class Diff
+Source::Source(const char* filename, int encoding)
+  : normalize_(normalizer(encoding)), map_(NULL), size_(0), scanned_(0), scanned_lno_(0), off_(0), pos_(0)
 {
-public:
-  Diff(Line* src, Line* dst, int mode) : src_(src), dst_(dst), mode_(mode) {}
-  ~Diff() {
-    if (src_) delete src_;
-    if (dst_) delete dst_;
+  map_ = map_file(filename, &size_);
+  index_.push_back(0);
+}
+
+bool Source::index_to(lno_t lno)
+{
+  while (scanned_lno_ < lno) {
+    if (scanned_ >= size_)
+      return false;
+    const char* lf = (const char*)memchr(map_ + scanned_, '\n', size_ - scanned_);
+    scanned_ = lf ? (lf - map_) + 1 : size_;
+    if (++scanned_lno_ % SOURCE_INDEX_STRIDE == 0)
+      index_.push_back(scanned_);
   }
-  Line* src() { return src_; }
-  Line* dst() { return dst_; }
-  int mode() { return mode_; }
-  void debug() {
-    fprintf(stderr, "[mode] %c\n", mode_);
-    if (src_) { fprintf(stderr, "[SRC] "); src_->debug(); }
-    else      { fprintf(stderr, "[SRC] null\n");          }
-    if (dst_) { fprintf(stderr, "[DST] "); dst_->debug(); }
-    else      { fprintf(stderr, "[DST] null\n");          }
+  return true;
+}
+
+void Source::seek(lno_t lno)
+{
+  if (lno < 0) lno = 0;
+  if (!index_to(lno)) lno = scanned_lno_;
+  size_t base = lno / SOURCE_INDEX_STRIDE;
+  size_t off = index_[base];
+  for (lno_t i = base * SOURCE_INDEX_STRIDE; i < lno; i++) {
+    const char* lf = (const char*)memchr(map_ + off, '\n', size_ - off);
+    off = lf ? (lf - map_) + 1 : size_;
   }
-private:
-  Line* src_;
-  Line* dst_;
-  int mode_;
-};
+  off_ = off;
+  pos_ = lno;
+}
 
-class Analyzer
+// the lines left, counted and passed over
+lno_t Source::skip_rest()
+{
+  lno_t lines = 0;
+  const char* p = map_ + off_;
+  const char* end = map_ + size_;
+  while (p != end) {
+    const char* lf = (const char*)memchr(p, '\n', end - p);
+    p = lf ? lf + 1 : end;
+    lines++;
+  }
+  off_ = size_;
+  pos_ += lines;
+  return lines;
+}
+
+bool Source::readline(NormLine* line)
+{
+  if (off_ >= size_)
+    return false;
+  const char* p = map_ + off_;
+  const char* lf = (const char*)memchr(p, '\n', size_ - off_);
+  size_t len = lf ? (lf - p) + 1 : size_ - off_;
+  off_ += len;
+  if (++pos_ > scanned_lno_) {
+    scanned_lno_ = pos_;
+    scanned_ = off_;
+    if (scanned_lno_ % SOURCE_INDEX_STRIDE == 0)
+      index_.push_back(scanned_);
+  }
+  *line = normalize_(p, len, &expanded_);
+  stats.source_lines++;
+  stats.source_normalized++;
+  return true;
+}
+
+#define SIDE_SRC (0)
+#define SIDE_DST (1)
+
+// creates an unlinked file in $TMPDIR (or /tmp) for scratch data
+int anon_tempfile()
+{
+  const char* dir = getenv("TMPDIR");
+  if (!dir || !*dir) dir = "/tmp";
+#ifdef O_TMPFILE
+  int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+  if (fd >= 0)
+    return fd;
+#endif
+  std::string path = std::string(dir) + "/diffedit-XXXXXX";
+  int tmp = mkstemp(&path[0]);
+  if (tmp < 0)
+    THROW_EXCEPTION("mkstemp(%s) %s", path.c_str(), strerror(errno));
+  unlink(path.c_str());
+  return tmp;
+}
+
+// the hunk text of one file: every stored line back to back in one
+// buffer as a record (header and bytes), released in one go once the
+// file has been printed.  With a budget, the buffered records go to an
+// anonymous temp file whenever they would outgrow it, and are streamed
+// back through a small window when read; a record is addressed by its
+// offset in the whole stream either way.  Views handed out by next()
+// stay valid until the next add() or next() on the same window
+class Arena
 {
 public:
-  Analyzer(Reader* reader) : reader_(reader) {reader_->reset();}
-  ~Analyzer() { delete reader_; }
-  static Analyzer* create(Reader* reader);
-  const char* getsrc();
-  virtual Diff* getdiff() = 0;
-protected:
-  char* parse_filename(char* line);
-  Reader* reader_;
+  // a reader's view into the spilled part
+  struct Window
+  {
+    Window() : off(0) {}
+    std::string buf;
+    size_t off;
+  };
+  Arena(size_t budget = 0) : budget_(budget), base_(0), fd_(-1) {}
+  ~Arena() {
+    if (fd_ >= 0) close(fd_);
+  }
+  size_t add(const NormLine& line, int side);
+  bool next(size_t* pos, size_t end, int side, NormLine* line, Window* window);
+  size_t size() const { return base_ + text_.size(); }
+  void clear();
 private:
-  char* get_src_filename(char* filename);
+  struct Header
+  {
+    uint64_t len; // a line of 4 GiB and more is kept whole
+    int32_t colums;
+    int32_t side;
+  };
+  void spill();
+  const char* record(size_t pos, size_t n, Window* window);
+  size_t budget_;
+  std::string text_; // records from base_ on
+  size_t base_;      // bytes spilled
+  int fd_;
 };
 
-class UnifiedAnalyzer : public Analyzer
+size_t Arena::add(const NormLine& line, int side)
 {
-public:
-  UnifiedAnalyzer(Reader* reader) : Analyzer(reader) {}
-  ~UnifiedAnalyzer() {}
-  virtual Diff* getdiff();
+  Header h = { line.len, line.colums, side };
+  if (budget_ && !text_.empty() && text_.size() + sizeof(h) + line.len > budget_)
+    spill();
+  size_t pos = size();
+  text_.append((const char*)&h, sizeof(h));
+  text_.append(line.ptr, line.len);
+  return pos;
+}
+
+void Arena::spill()
+{
+  if (fd_ < 0)
+    fd_ = anon_tempfile();
+  size_t done = 0;
+  while (done < text_.size()) {
+    ssize_t n = pwrite(fd_, text_.data() + done, text_.size() - done, base_ + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      THROW_EXCEPTION("pwrite() %s", strerror(errno));
+    }
+    done += n;
+  }
+  base_ += text_.size();
+  stats.spill_bytes += text_.size();
+  text_.clear();
+}
+
+// n bytes at stream offset pos; spilled ones are read SPILL_READ_SIZE
+// at a time
+const char* Arena::record(size_t pos, size_t n, Window* window)
+{
+  if (pos >= base_)
+    return text_.data() + (pos - base_);
+  if (pos < window->off || pos + n > window->off + window->buf.size()) {
+    size_t len = std::min(std::max(n, (size_t)SPILL_READ_SIZE), base_ - pos);
+    window->buf.resize(len);
+    window->off = pos;
+    size_t done = 0;
+    while (done < len) {
+      ssize_t r = pread(fd_, &window->buf[done], len - done, pos + done);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0)
+        THROW_EXCEPTION("pread() %s", r ? strerror(errno) : "short read");
+      done += r;
+    }
+  }
+  return window->buf.data() + (pos - window->off);
+}
+
+// the record at *pos or the first after it on the given side
+bool Arena::next(size_t* pos, size_t end, int side, NormLine* line, Window* window)
+{
+  while (*pos < end) {
+    Header h;
+    memcpy(&h, record(*pos, sizeof(h), window), sizeof(h));
+    size_t at = *pos;
+    *pos += sizeof(h) + h.len;
+    if (h.side == side) {
+      const char* p = record(at, sizeof(h) + h.len, window) + sizeof(h);
+      *line = NormLine(StrRef(p, h.len), h.colums);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Arena::clear()
+{
+  text_.clear();
+  if (base_ && ftruncate(fd_, 0) < 0)
+    THROW_EXCEPTION("ftruncate() %s", strerror(errno));
+  base_ = 0;
+}
+
+// one side of a hunk: a range of arena records, read back in order.
+// The two sides of a hunk share the range when a patch interleaves them
+class Line
+{
+public:
+  Line() : start_(0), end_(0), arena_(NULL), side_(SIDE_SRC),
+           first_(0), last_(0), next_(0) {}
+  void init(Arena* arena, int side, lno_t start, lno_t end) {
+    arena_ = arena;
+    side_ = side;
+    start_ = start;
+    end_ = end;
+    first_ = last_ = next_ = arena->size();
+  }
+  void set_start(lno_t start) { start_ = start; }
+  void set_end(lno_t end) { end_ = end; }
+  lno_t start() { return start_; }
+  lno_t end() { return end_; }
+  void addstr(const NormLine& str) {
+    size_t pos = arena_->add(str, side_);
+    if (first_ == last_) first_ = next_ = pos;
+    last_ = arena_->size();
+  }
+  bool getstr(NormLine* line) {
+    return arena_->next(&next_, last_, side_, line, &window_);
+  }
+  uint64_t hash(uint64_t h);
+  void debug() {
+    fprintf(stderr, "start[%5lld] end[%5lld]\n", (long long)start_, (long long)end_);
+    NormLine line;
+    Arena::Window window;
+    for (size_t pos = first_; arena_->next(&pos, last_, side_, &line, &window);)
+      fprintf(stderr, "[%.*s]\n", (int)line.len, line.ptr);
+  }
+private:
+  lno_t start_;
+  lno_t end_;
+  Arena* arena_;
+  int side_;
+  size_t first_;
+  size_t last_;
+  size_t next_;
+  Arena::Window window_;
+};
+
+// a hunk; both sides are held in place and their text in the arena
+class Diff
+{
+public:
+  Diff(Arena* arena, int mode = 0)
+    : arena_(arena), mode_(mode), has_src_(false), has_dst_(false) {
+    stats.hunks++;
+  }
+  Line* src() { return has_src_ ? &src_ : NULL; }
+  Line* dst() { return has_dst_ ? &dst_ : NULL; }
+  Line* add_src(lno_t start = 0, lno_t end = 0) {
+    if (!has_src_) src_.init(arena_, SIDE_SRC, start, end);
+    has_src_ = true;
+    return &src_;
+  }
+  Line* add_dst(lno_t start = 0, lno_t end = 0) {
+    if (!has_dst_) dst_.init(arena_, SIDE_DST, start, end);
+    has_dst_ = true;
+    return &dst_;
+  }
+  int mode() { return mode_; }
+  void set_mode(int mode) { mode_ = mode; }
+  // folds what the hunk shows into h, for the render cache
+  uint64_t hash(uint64_t h);
+  void debug() {
+    fprintf(stderr, "[mode] %c\n", mode_);
+    if (has_src_) { fprintf(stderr, "[SRC] "); src_.debug(); }
+    else          { fprintf(stderr, "[SRC] null\n");         }
+    if (has_dst_) { fprintf(stderr, "[DST] "); dst_.debug(); }
+    else          { fprintf(stderr, "[DST] null\n");         }
+  }
+private:
+  Arena* arena_;
+  int mode_;
+  bool has_src_;
+  bool has_dst_;
+  Line src_;
+  Line dst_;
+};
+
+class Analyzer
+{
+public:
+  Analyzer() : reader_(NULL), arena_(NULL), budget_(0) {}
+  Analyzer(Reader* reader) : reader_(reader), arena_(NULL), budget_(0) {reader_->reset();}
+  virtual ~Analyzer() {
+    delete reader_;
+    delete arena_;
+  }
+  static Analyzer* create(Reader* reader);
+  // an analyzer of the same format over another reader
+  virtual Analyzer* another(Reader*) { return NULL; }
+  virtual const char* getsrc();
+  virtual Diff* getdiff() = 0;
+  static StrRef parse_filename(StrRef line);
+  // hunk text of the file last returned by getsrc(), cleared by the
+  // printer after the file; take_arena() hands it over for good
+  Arena* arena() { return arena_; }
+  Arena* take_arena() {
+    Arena* arena = arena_;
+    arena_ = NULL;
+    return arena;
+  }
+  // hands over the text of the diffs returned so far; the rest of the
+  // file goes to a new arena
+  Arena* cut_arena() {
+    Arena* arena = arena_;
+    arena_ = new Arena(budget_);
+    return arena;
+  }
+  // parses a stream through its Reader, rather than files prepared ahead
+  bool streams() { return reader_ != NULL; }
+  // bytes of hunk text a file's arena keeps in memory, 0 for no limit
+  void set_budget(size_t budget) { budget_ = budget; }
+protected:
+  Reader* reader_;
+  Arena* arena_;
+  size_t budget_;
+private:
+  std::string filename_;
+};
+
+class UnifiedAnalyzer : public Analyzer
+{
+public:
+  UnifiedAnalyzer(Reader* reader)
+    : Analyzer(reader), src_b_(0), src_c_(0), dst_b_(0), dst_c_(0) {}
+  ~UnifiedAnalyzer() {}
+  virtual Analyzer* another(Reader* reader) { return new UnifiedAnalyzer(reader); }
+  virtual Diff* getdiff();
 private:
-  char* parse_base_line(char* line, int* src_b, int* dst_b);
-  bool is_ignore(char* line);
+  bool parse_base_line(StrRef line, lno_t* src_b, lno_t* dst_b);
+  bool is_ignore(StrRef line);
   bool is_diff_start();
   bool is_diff_boundary_src();
   bool is_diff_boundary_dst();
   bool is_diff_end();
+  // hunk base lines and the lines counted since, kept across calls
+  lno_t src_b_, src_c_;
+  lno_t dst_b_, dst_c_;
 };
 
 class ContextAnalyzer : public Analyzer
@@ -407,11 +1448,12 @@ class ContextAnalyzer : public Analyzer
 public:
   ContextAnalyzer(Reader* reader) : Analyzer(reader) {}
   ~ContextAnalyzer() {}
+  virtual Analyzer* another(Reader* reader) { return new ContextAnalyzer(reader); }
   virtual Diff* getdiff();
 private:
-  char* parse_line_no(char* line, int* src_s, int* src_e,
-                      int* dst_s, int* dst_e, int* mode);
-  bool is_ignore(char* line);
+  bool parse_line_no(StrRef line, lno_t* src_s, lno_t* src_e,
+                     lno_t* dst_s, lno_t* dst_e, int* mode);
+  bool is_ignore(StrRef line);
 };
 
 Analyzer* Analyzer::create(Reader* reader)
@@ -419,8 +1461,9 @@ Analyzer* Analyzer::create(Reader* reader)
   int unified, context;
   unified = context = 0;
   for (int i = 0; i < reader->cachesize(); i++) {
-    char* line = reader->readline();
-    switch (line[0]) {
+    NormLine line;
+    reader->readline(&line);
+    switch (line.at(0)) {
     case '+':
     case '-':
     case '@':
@@ -439,49 +1482,40 @@ Analyzer* Analyzer::create(Reader* reader)
 
 const char* Analyzer::getsrc()
 {
-  static char filename[FILENAMESIZE];
-  memset(filename, 0, sizeof(filename));
-  if (get_src_filename(filename))
-    return filename;
-  return NULL;
-}
-
-char* Analyzer::get_src_filename(char* filename)
-{
-  char* line = NULL;
-  while(line = reader_->readline()) {
-    if (char* p = parse_filename(line)) {
-      strcpy(filename, p);
-      trimspace(filename);
-      break;
+  if (!arena_) arena_ = new Arena(budget_);
+  NormLine line;
+  while (reader_->readline(&line)) {
+    StrRef name = parse_filename(line);
+    if (name.ptr) {
+      name = trimspace(name);
+      filename_.assign(name.ptr, name.len);
+      return filename_.c_str();
     }
   }
-  return line;
+  return NULL;
 }
 
-char* Analyzer::parse_filename(char* line)
+StrRef Analyzer::parse_filename(StrRef line)
 {
-  if (!strncmp(line, "Index:", 6))
-    return line+6;
-  if (!strncmp(line, "diff ", 5))
-    if (char* p = strrchr(line, '/'))
-      return ++p;
-  return NULL;
+  if (line.len >= 6 && !memcmp(line.ptr, "Index:", 6))
+    return line.sub(6);
+  if (line.len >= 5 && !memcmp(line.ptr, "diff ", 5))
+    if (const char* p = (const char*)memrchr(line.ptr, '/', line.len))
+      return line.sub(p - line.ptr + 1);
+  return StrRef();
 }
 
 Diff* UnifiedAnalyzer::getdiff()
 {
-  static int src_b, src_c;
-  static int dst_b, dst_c;
-  int src_s, src_e;
-  int dst_s, dst_e;
-  int mode;
+  lno_t src_s = 0, src_e = 0;
+  lno_t dst_s = 0, dst_e = 0;
+  int mode = MODE_MOD;
 
-  Line* src = NULL;
-  Line* dst = NULL;
+  Diff* diff = NULL;
 
-  while (char* line = reader_->readline()) {
-    if (parse_filename(line)) {
+  NormLine line;
+  while (reader_->readline(&line)) {
+    if (parse_filename(line).ptr) {
       reader_->rewind();
       break;
     }
@@ -489,126 +1523,130 @@ Diff* UnifiedAnalyzer::getdiff()
     if (is_ignore(line))
       continue;
 
-    if (parse_base_line(line, &src_b, &dst_b)) {
-      src_c = dst_c = -1;
+    if (parse_base_line(line, &src_b_, &dst_b_)) {
+      src_c_ = dst_c_ = -1;
       continue;
     }
 
-    if (reader_->crnt()[0] == ' ') {
-      src_c++;
-      dst_c++;
-    } else if (reader_->crnt()[0] == '-') {
-      if (!src) src = new Line();
-      src->addstr(&reader_->crnt()[1]);
-      src_c++;
-    } else if (reader_->crnt()[0] == '+') {
-      if (!dst) dst = new Line();
-      dst->addstr(&reader_->crnt()[1]);
-      dst_c++;
+    if (reader_->crnt().at(0) == ' ') {
+      src_c_++;
+      dst_c_++;
+    } else if (reader_->crnt().at(0) == '-') {
+      if (!diff) diff = new Diff(arena_);
+      diff->add_src()->addstr(reader_->body(1));
+      src_c_++;
+    } else if (reader_->crnt().at(0) == '+') {
+      if (!diff) diff = new Diff(arena_);
+      diff->add_dst()->addstr(reader_->body(1));
+      dst_c_++;
     }
 
     if (is_diff_start()) {
       src_s = src_e = dst_s = dst_e = 0;
-      if (reader_->crnt()[0] == '-') {
-        src_s = src_b + src_c;
+      if (reader_->crnt().at(0) == '-') {
+        src_s = src_b_ + src_c_;
         mode = MODE_DEL;
       } else {
-        dst_s = dst_b + dst_c;
+        dst_s = dst_b_ + dst_c_;
         mode = MODE_ADD;
       }
     }
     if (is_diff_boundary_src()) {
-      src_e = src_b + src_c;
+      src_e = src_b_ + src_c_;
       mode = MODE_MOD;
     }
     if (is_diff_boundary_dst()) {
-      dst_s = dst_b + dst_c;
+      dst_s = dst_b_ + dst_c_;
       mode = MODE_MOD;
     }
     if (is_diff_end()) {
-      if (reader_->crnt()[0] == '-')
-        src_e = src_b + src_c;
+      if (reader_->crnt().at(0) == '-')
+        src_e = src_b_ + src_c_;
       else
-        dst_e = dst_b + dst_c;
+        dst_e = dst_b_ + dst_c_;
 
-      if (src) {
+      if (Line* src = diff->src()) {
         src->set_start(src_s);
         src->set_end(src_e);
       }
-      if (dst) {
+      if (Line* dst = diff->dst()) {
         dst->set_start(dst_s);
         dst->set_end(dst_e);
       }
-      Diff* diff = new Diff(src, dst, mode);
-      src = dst = NULL;
+      diff->set_mode(mode);
       return diff;
     }
   }
+  delete diff;
   return NULL;
 }
 
-char* UnifiedAnalyzer::parse_base_line(char* line, int* src_b, int* dst_b)
+bool UnifiedAnalyzer::parse_base_line(StrRef line, lno_t* src_b, lno_t* dst_b)
 {
-  if (line[0] == '@' && line[1] == '@') {
-    if (line = strchr(line, '-')) {
-      line++;
-      *src_b = atoi(line);
+  if (line.at(0) == '@' && line.at(1) == '@') {
+    const char* end = line.ptr + line.len;
+    const char* p = line.ptr;
+    if ((p = (const char*)memchr(p, '-', end - p))) {
+      p++;
+      *src_b = strtolno(p, end);
+    } else {
+      return false;
     }
-    if (line = strchr(line, '+')) {
-      line++;
-      *dst_b = atoi(line);
+    if ((p = (const char*)memchr(p, '+', end - p))) {
+      p++;
+      *dst_b = strtolno(p, end);
     }
-    return line;
+    return p != NULL;
   }
-  return NULL;
+  return false;
 }
 
-bool UnifiedAnalyzer::is_ignore(char* line) {
-  if (!strncmp(line, "---", 3)) return true;
-  if (!strncmp(line, "+++", 3)) return true;
-  if (line[0] == '=') return true;
+bool UnifiedAnalyzer::is_ignore(StrRef line) {
+  if (line.len >= 3 && !memcmp(line.ptr, "---", 3)) return true;
+  if (line.len >= 3 && !memcmp(line.ptr, "+++", 3)) return true;
+  if (line.at(0) == '=') return true;
   return false;
 }
 
 bool UnifiedAnalyzer::is_diff_start()
 {
-  if (reader_->prev()[0] != '-' && reader_->prev()[0] != '+')
-    if (reader_->crnt()[0] == '-' || reader_->crnt()[0] == '+')
+  if (reader_->prev().at(0) != '-' && reader_->prev().at(0) != '+')
+    if (reader_->crnt().at(0) == '-' || reader_->crnt().at(0) == '+')
       return true;
   return false;
 }
 
 bool UnifiedAnalyzer::is_diff_boundary_src()
 {
-  if (reader_->crnt()[0] == '-' && reader_->next()[0] == '+')
+  if (reader_->crnt().at(0) == '-' && reader_->next().at(0) == '+')
     return true;
   return false;
 }
 
 bool UnifiedAnalyzer::is_diff_boundary_dst()
 {
-  if (reader_->prev()[0] == '-' && reader_->crnt()[0] == '+')
+  if (reader_->prev().at(0) == '-' && reader_->crnt().at(0) == '+')
     return true;
   return false;
 }
 
 bool UnifiedAnalyzer::is_diff_end()
 {
-  if (reader_->crnt()[0] == '-' || reader_->crnt()[0] == '+')
-    if (reader_->next()[0] != '-' && reader_->next()[0] != '+')
+  if (reader_->crnt().at(0) == '-' || reader_->crnt().at(0) == '+')
+    if (reader_->next().at(0) != '-' && reader_->next().at(0) != '+')
       return true;
   return false;
 }
 
 Diff* ContextAnalyzer::getdiff()
 {
-  int src_s, src_e, dst_s, dst_e;
-  int mode, found_mode = 0;
-  Line* src = NULL;
-  Line* dst = NULL;
+  lno_t src_s, src_e, dst_s, dst_e;
+  int mode;
+  Diff* diff = NULL;
 
-  while (char* line = reader_->readline()) {
-    if (parse_filename(line)) {
+  NormLine line;
+  while (reader_->readline(&line)) {
+    if (parse_filename(line).ptr) {
       reader_->rewind();
       break;
     }
@@ -616,334 +1654,2953 @@ Diff* ContextAnalyzer::getdiff()
     if (is_ignore(line))
       continue;
 
-    if (line[0] == '<') {
-      src->addstr(&line[2]);
+    if (line.at(0) == '<') {
+      diff->src()->addstr(reader_->body(2));
       continue;
     }
-    if (line[0] == '>') {
-      dst->addstr(&line[2]);
+    if (line.at(0) == '>') {
+      diff->dst()->addstr(reader_->body(2));
       continue;
     }
 
     if (parse_line_no(line, &src_s, &src_e, &dst_s, &dst_e, &mode)) {
-      if (found_mode) {
+      if (diff) {
         reader_->rewind();
-        return new Diff(src, dst, found_mode);
-      }
-      found_mode = mode;
-      if (mode == MODE_DEL)
-        src = new Line(src_s, src_e);
-      else if (mode == MODE_ADD)
-        dst = new Line(dst_s, dst_e);
-      else {
-        src = new Line(src_s, src_e);
-        dst = new Line(dst_s, dst_e);
+        return diff;
       }
+      diff = new Diff(arena_, mode);
+      if (mode != MODE_ADD)
+        diff->add_src(src_s, src_e);
+      if (mode != MODE_DEL)
+        diff->add_dst(dst_s, dst_e);
     }
   }
-  if (found_mode)
-    return new Diff(src, dst, found_mode);
-  return NULL;
+  return diff;
 }
 
-bool ContextAnalyzer::is_ignore(char* line)
+bool ContextAnalyzer::is_ignore(StrRef line)
 {
-  if (isdigit(line[0]))
+  if (isdigit(line.at(0)))
     return false;
-  if (line[0] == '<' || line[0] == '>')
+  if (line.at(0) == '<' || line.at(0) == '>')
     return false;
   return true;
 }
 
-char* ContextAnalyzer::parse_line_no(char* line, int* src_s, int* src_e,
-                                     int* dst_s, int* dst_e, int* mode)
+bool ContextAnalyzer::parse_line_no(StrRef line, lno_t* src_s, lno_t* src_e,
+                                    lno_t* dst_s, lno_t* dst_e, int* mode)
 {
-  char* src = line;
-  char* dst;
-  if (!(dst = strchr(src, 'a')))
-    if (!(dst = strchr(src, 'd')))
-      if (!(dst = strchr(src, 'c')))
-        return NULL;
+  const char* src = line.ptr;
+  const char* end = line.ptr + line.len;
+  const char* dst;
+  if (!(dst = (const char*)memchr(src, 'a', line.len)))
+    if (!(dst = (const char*)memchr(src, 'd', line.len)))
+      if (!(dst = (const char*)memchr(src, 'c', line.len)))
+        return false;
 
   if (*dst == 'a') *mode = MODE_ADD;
-  if (*dst == 'd') *mode = MODE_DEL;
-  if (*dst == 'c') *mode = MODE_MOD;
-  *dst = 0;
+  else if (*dst == 'd') *mode = MODE_DEL;
+  else *mode = MODE_MOD;
+  const char* src_end = dst;
   dst++;
 
-  *src_e = *src_s = atoi(src);
-  *dst_e = *dst_s = atoi(dst);
+  *src_e = *src_s = strtolno(src, src_end);
+  *dst_e = *dst_s = strtolno(dst, end);
 
-  if (src = strchr(src, ','))
-    *src_e = atoi(++src);
+  if ((src = (const char*)memchr(src, ',', src_end - src)))
+    *src_e = strtolno(++src, src_end);
 
-  if (dst = strchr(dst, ','))
-    *dst_e = atoi(++dst);
-  return line;
+  if ((dst = (const char*)memchr(dst, ',', end - dst)))
+    *dst_e = strtolno(++dst, end);
+  return true;
 }
 
-class Writer
+inline uint64_t hash_mix(uint64_t h, uint64_t w)
+{
+  h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+  return h ^ (h >> 32);
+}
+
+// 64-bit hash of a raw line or a whole file, eight bytes at a time
+inline uint64_t hash_bytes(const char* p, size_t len)
+{
+  uint64_t h = len * 0x9E3779B97F4A7C15ULL;
+  uint64_t w;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = hash_mix(h, w);
+  }
+  if (len) {
+    w = 0;
+    memcpy(&w, p, len);
+    h = hash_mix(h, w);
+  }
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  return h ^ (h >> 33);
+}
+
+// folds the side's line span and text into h
+uint64_t Line::hash(uint64_t h)
+{
+  h = hash_mix(h, start_);
+  h = hash_mix(h, end_);
+  NormLine line;
+  Arena::Window window;
+  for (size_t pos = first_; arena_->next(&pos, last_, side_, &line, &window);)
+    h = hash_mix(h, hash_bytes(line.ptr, line.len));
+  return h;
+}
+
+uint64_t Diff::hash(uint64_t h)
+{
+  h = hash_mix(h, mode_);
+  h = has_src_ ? src_.hash(hash_mix(h, 1)) : hash_mix(h, 0);
+  return has_dst_ ? dst_.hash(hash_mix(h, 1)) : hash_mix(h, 0);
+}
+
+// gives equal lines the same small integer id, so that the diff engine
+// compares ints; a hash match is confirmed with memcmp
+class LineTable
 {
 public:
-  Writer(int colum, int encoding,  FILE* fp = stdout)
-    : colum_(colum), encoding_(encoding), fp_(fp), isSelfOpened_(false) {
-    if (init(colum_))
-      THROW_EXCEPTION("memory short");
+  LineTable() : mask_(0) {}
+  void reset(size_t lines);
+  int id(StrRef line);
+  int count() { return lines_.size(); }
+private:
+  std::vector<int> slots_; // id + 1, 0 for an empty slot
+  std::vector<StrRef> lines_;
+  std::vector<uint64_t> hashes_;
+  size_t mask_;
+};
+
+void LineTable::reset(size_t lines)
+{
+  size_t size = 16;
+  while (size < lines * 2) size <<= 1;
+  slots_.assign(size, 0);
+  mask_ = size - 1;
+  lines_.clear();
+  hashes_.clear();
+}
+
+int LineTable::id(StrRef line)
+{
+  uint64_t h = hash_bytes(line.ptr, line.len);
+  for (size_t i = h & mask_;; i = (i + 1) & mask_) {
+    int id = slots_[i] - 1;
+    if (id < 0) {
+      slots_[i] = lines_.size() + 1;
+      lines_.push_back(line);
+      hashes_.push_back(h);
+      return lines_.size() - 1;
+    }
+    if (hashes_[id] == h && lines_[id].len == line.len &&
+        !memcmp(lines_[id].ptr, line.ptr, line.len))
+      return id;
   }
-  Writer(const char* filename, int colum, int encoding)
-    : colum_(colum), encoding_(encoding), isSelfOpened_(true) {
-    if (!(fp_ = fopen(filename, "w")))
-      THROW_EXCEPTION("fopen(%s) %s", filename, strerror(errno));
+}
 
-    if (init(colum_)) {
-      fclose(fp_);
-      THROW_EXCEPTION("memory short");
+// in-process line diff over id arrays.  Common prefix and suffix are
+// trimmed, lines unique to both sides anchor the rest (patience), and
+// what lies between anchors goes to Myers' O(ND) search; past
+// max_cost edits a region is reported as changed as a whole
+class DiffEngine
+{
+public:
+  DiffEngine(int max_cost = DIFF_MAX_COST) : max_cost_(max_cost), gaveup_(0) {}
+  void compare(const std::vector<int>& a, const std::vector<int>& b, int ids);
+  bool src_changed(size_t i) { return changed_a_[i]; }
+  bool dst_changed(size_t j) { return changed_b_[j]; }
+  // regions of the last compare() marked whole past max_cost
+  int gaveup() { return gaveup_; }
+private:
+  void compare(int a0, int a1, int b0, int b1);
+  bool anchor(int a0, int a1, int b0, int b1);
+  void myers(int a0, int a1, int b0, int b1);
+  void change(int a0, int a1, int b0, int b1);
+  const int* a_;
+  const int* b_;
+  std::vector<char> changed_a_;
+  std::vector<char> changed_b_;
+  std::vector<int> count_a_;
+  std::vector<int> count_b_;
+  std::vector<int> pos_b_;
+  std::vector<int> cand_;
+  std::vector<int> tops_;
+  std::vector<int> link_;
+  std::vector<int> run_;
+  std::vector<int> v_;
+  std::vector<int> trace_;
+  int max_cost_;
+  int gaveup_;
+};
+
+void DiffEngine::compare(const std::vector<int>& a, const std::vector<int>& b, int ids)
+{
+  a_ = a.empty() ? NULL : &a[0];
+  b_ = b.empty() ? NULL : &b[0];
+  changed_a_.assign(a.size(), 0);
+  changed_b_.assign(b.size(), 0);
+  count_a_.assign(ids, 0);
+  count_b_.assign(ids, 0);
+  pos_b_.assign(ids, 0);
+  gaveup_ = 0;
+  compare(0, a.size(), 0, b.size());
+}
+
+void DiffEngine::change(int a0, int a1, int b0, int b1)
+{
+  for (int i = a0; i < a1; i++) changed_a_[i] = 1;
+  for (int j = b0; j < b1; j++) changed_b_[j] = 1;
+}
+
+void DiffEngine::compare(int a0, int a1, int b0, int b1)
+{
+  while (a0 < a1 && b0 < b1 && a_[a0] == b_[b0]) {
+    a0++;
+    b0++;
+  }
+  while (a0 < a1 && b0 < b1 && a_[a1 - 1] == b_[b1 - 1]) {
+    a1--;
+    b1--;
+  }
+  if (a0 == a1 || b0 == b1)
+    change(a0, a1, b0, b1);
+  else if (!anchor(a0, a1, b0, b1))
+    myers(a0, a1, b0, b1);
+}
+
+// matches the lines occurring once on each side along their longest
+// increasing run, then compares the gaps between them
+bool DiffEngine::anchor(int a0, int a1, int b0, int b1)
+{
+  for (int i = a0; i < a1; i++) count_a_[a_[i]]++;
+  for (int j = b0; j < b1; j++) {
+    count_b_[b_[j]]++;
+    pos_b_[b_[j]] = j;
+  }
+  std::vector<int>& cand = cand_; // positions in a of the unique common lines
+  cand.clear();
+  for (int i = a0; i < a1; i++)
+    if (count_a_[a_[i]] == 1 && count_b_[a_[i]] == 1)
+      cand.push_back(i);
+  for (int i = a0; i < a1; i++) count_a_[a_[i]] = 0;
+  for (int j = b0; j < b1; j++) count_b_[b_[j]] = 0;
+  if (cand.empty())
+    return false;
+
+  // patience sort: tops[k] ends the best run of length k + 1
+  std::vector<int>& tops = tops_;
+  std::vector<int>& link = link_;
+  tops.clear();
+  link.assign(cand.size(), -1);
+  for (size_t c = 0; c < cand.size(); c++) {
+    int j = pos_b_[a_[cand[c]]];
+    size_t lo = 0, hi = tops.size();
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (pos_b_[a_[cand[tops[mid]]]] < j) lo = mid + 1;
+      else hi = mid;
     }
+    if (lo) link[c] = tops[lo - 1];
+    if (lo == tops.size()) tops.push_back(c);
+    else tops[lo] = c;
   }
-  ~Writer() {
-    if (fp_ && isSelfOpened_) fclose(fp_);
-    if (left_) free(left_);
-    if (right_) free(right_);
+  // the run goes on a stack shared with the nested compares, last first
+  size_t base = run_.size();
+  for (int c = tops.back(); c >= 0; c = link[c])
+    run_.push_back(cand[c]);
+
+  int i = a0, j = b0;
+  for (size_t k = run_.size(); k-- > base;) {
+    int ai = run_[k];
+    int bj = pos_b_[a_[ai]];
+    compare(i, ai, j, bj);
+    i = ai + 1;
+    j = bj + 1;
   }
-  void header(const char* filename);
-  void format(int lno, const char* l, int rno, const char* r, char mode);
-  void LF();
+  run_.resize(base);
+  compare(i, a1, j, b1);
+  return true;
+}
+
+// greedy forward search keeping each round's diagonals for the walk back
+void DiffEngine::myers(int a0, int a1, int b0, int b1)
+{
+  int n = a1 - a0, m = b1 - b0;
+  int max = n + m;
+  if (max > max_cost_) max = max_cost_;
+  std::vector<int>& v = v_;
+  v.assign(2 * max + 3, 0);
+  int off = max + 1;
+  trace_.clear();
+
+  int d, x = 0, y = 0;
+  for (d = 0; d <= max; d++) {
+    trace_.insert(trace_.end(), v.begin() + off - d, v.begin() + off + d + 1);
+    int k;
+    for (k = -d; k <= d; k += 2) {
+      if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+        x = v[off + k + 1];
+      else
+        x = v[off + k - 1] + 1;
+      y = x - k;
+      while (x < n && y < m && a_[a0 + x] == b_[b0 + y]) {
+        x++;
+        y++;
+      }
+      v[off + k] = x;
+      if (x >= n && y >= m) break;
+    }
+    if (k <= d) break;
+  }
+  if (d > max) {
+    change(a0, a1, b0, b1);
+    gaveup_++;
+    return;
+  }
+
+  x = n;
+  y = m;
+  for (; d > 0; d--) {
+    // round d started from trace_[d * d, d * d + 2d], diagonals -d..d
+    const int* prev = &trace_[d * d] + d;
+    int k = x - y;
+    int pk = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+    int px = prev[pk];
+    int py = px - pk;
+    bool insert = (pk == k + 1);
+    while (x > px + !insert && y > py + insert) {
+      x--;
+      y--;
+    }
+    if (insert)
+      changed_b_[b0 + py] = 1;
+    else
+      changed_a_[a0 + px] = 1;
+    x = px;
+    y = py;
+  }
+}
+
+// length of the common prefix of a[0..n) and b[0..n), compared a vector
+// at a time
+size_t common_prefix(const char* a, const char* b, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y) break;
+  }
+  for (; i < n && a[i] == b[i]; i++);
+  return i;
+}
+
+// the same for the common suffix of the n bytes ending at a and b
+size_t common_suffix(const char* a, const char* b, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a - i - 16));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b - i - 16));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (mask) return i + __builtin_clz(mask) - 16;
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a - i - 8, 8);
+    memcpy(&y, b - i - 8, 8);
+    if (x != y) break;
+  }
+  for (; i < n && a[-(long)i - 1] == b[-(long)i - 1]; i++);
+  return i;
+}
+
+// changed bytes of the two lines of a MODE_MOD row.  The common prefix and
+// suffix are skipped first; what is left is cut into words, runs of
+// blanks, single symbols and single multibyte characters, and compared by
+// a DiffEngine capped at INTRA_MAX_COST, past which it is marked whole
+template <class Enc>
+class IntraDiff
+{
+public:
+  IntraDiff() : engine_(INTRA_MAX_COST) {}
+  bool compare(StrRef a, StrRef b);
+  // one byte per byte of the line, 1 where changed
+  const char* src_marks() { return marks_a_.empty() ? NULL : &marks_a_[0]; }
+  const char* dst_marks() { return marks_b_.empty() ? NULL : &marks_b_[0]; }
 private:
-  int init(int colum);
-  char* folding(const char* in, char* out);
-  void encoding_check(unsigned char* in);
-  void getcolumsz(unsigned char* in, int* sz, int* colum);
-  void separator();
-  FILE* fp_;
-  int colum_;
-  int encoding_;
-  char* left_;
-  char* right_;
-  bool isSelfOpened_;
+  size_t char_start(StrRef line, size_t pos);
+  void tokenize(StrRef line, size_t from, size_t to, std::vector<StrRef>* tokens);
+  void mark(StrRef line, const std::vector<StrRef>& tokens, bool src,
+            std::vector<char>* marks);
+  LineTable table_;
+  DiffEngine engine_;
+  std::vector<StrRef> tokens_a_;
+  std::vector<StrRef> tokens_b_;
+  std::vector<int> ids_a_;
+  std::vector<int> ids_b_;
+  std::vector<char> marks_a_;
+  std::vector<char> marks_b_;
+};
+
+inline bool word_byte(unsigned char c)
+{
+  return ('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
+         ('a' <= c && c <= 'z') || c == '_';
+}
+
+// false if the lines are equal and nothing is marked
+template <class Enc>
+bool IntraDiff<Enc>::compare(StrRef a, StrRef b)
+{
+  size_t n = a.len < b.len ? a.len : b.len;
+  size_t pre = common_prefix(a.ptr, b.ptr, n);
+  size_t suf = common_suffix(a.ptr + a.len, b.ptr + b.len, n - pre);
+  if (pre + suf == a.len && pre + suf == b.len)
+    return false;
+  pre = char_start(a, pre);
+
+  tokenize(a, pre, a.len - suf, &tokens_a_);
+  tokenize(b, pre, b.len - suf, &tokens_b_);
+  table_.reset(tokens_a_.size() + tokens_b_.size());
+  ids_a_.clear();
+  ids_b_.clear();
+  for (size_t i = 0; i < tokens_a_.size(); i++)
+    ids_a_.push_back(table_.id(tokens_a_[i]));
+  for (size_t j = 0; j < tokens_b_.size(); j++)
+    ids_b_.push_back(table_.id(tokens_b_[j]));
+  engine_.compare(ids_a_, ids_b_, table_.count());
+  mark(a, tokens_a_, true, &marks_a_);
+  mark(b, tokens_b_, false, &marks_b_);
+  stats.intra_rows++;
+  if (engine_.gaveup()) stats.intra_capped++;
+  return true;
+}
+
+// the start of the character holding line.ptr[pos], so that tokens and
+// marks always cover whole characters
+template <class Enc>
+size_t IntraDiff<Enc>::char_start(StrRef line, size_t pos)
+{
+  const unsigned char* in = (const unsigned char*)line.ptr;
+  size_t i = 0;
+  while (i < pos) {
+    i += ascii_span(in + i, pos - i);
+    if (i >= pos) break;
+    int sz, col;
+    Enc::getcolumsz(in + i, line.len - i, &sz, &col);
+    if (i + sz > pos) break;
+    i += sz;
+  }
+  return i;
+}
+
+// the last token may run past to, to the end of its character
+template <class Enc>
+void IntraDiff<Enc>::tokenize(StrRef line, size_t from, size_t to,
+                              std::vector<StrRef>* tokens)
+{
+  tokens->clear();
+  const unsigned char* in = (const unsigned char*)line.ptr;
+  size_t i = from;
+  while (i < to) {
+    size_t start = i;
+    if (in[i] & 0x80) {
+      int sz, col;
+      Enc::getcolumsz(in + i, line.len - i, &sz, &col);
+      i += sz;
+    } else if (word_byte(in[i])) {
+      while (i < to && word_byte(in[i])) i++;
+    } else if (in[i] == ' ') {
+      while (i < to && in[i] == ' ') i++;
+    } else {
+      i++;
+    }
+    tokens->push_back(StrRef(line.ptr + start, i - start));
+  }
+}
+
+template <class Enc>
+void IntraDiff<Enc>::mark(StrRef line, const std::vector<StrRef>& tokens, bool src,
+                          std::vector<char>* marks)
+{
+  marks->assign(line.len, 0);
+  for (size_t i = 0; i < tokens.size(); i++)
+    if (src ? engine_.src_changed(i) : engine_.dst_changed(i))
+      memset(&(*marks)[tokens[i].ptr - line.ptr], 1, tokens[i].len);
+}
+
+// size, mtime and content hash of a file, as kept by MetaCache
+struct FileMeta
+{
+  FileMeta() : size(0), mtime(0), hash(0) {}
+  FileMeta(const struct stat& st)
+    : size(st.st_size),
+      mtime(st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec), hash(0) {}
+  uint64_t size;
+  int64_t mtime; // nsec
+  uint64_t hash;
+};
+
+// "$XDG_CACHE_HOME/diffedit" or "$HOME/.cache/diffedit", created on
+// demand; empty when neither is usable
+std::string cache_dir()
+{
+  std::string dir;
+  if (const char* xdg = getenv("XDG_CACHE_HOME"))
+    dir = xdg;
+  else if (const char* home = getenv("HOME"))
+    dir = std::string(home) + "/.cache";
+  else
+    return "";
+  mkdir(dir.c_str(), 0755);
+  dir.append("/diffedit");
+  if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+    return "";
+  return dir;
+}
+
+// per-tree file of path, size, mtime and hash, so that the next run
+// knows an unchanged file from its stat() alone.  The cache is best
+// effort: a missing or unwritable one only costs the hashing
+class MetaCache
+{
+public:
+  MetaCache() : dirty_(false) {}
+  void load(const char* tree);
+  bool find(const std::string& path, const FileMeta& st, uint64_t* hash) const;
+  void update(const std::string& path, const FileMeta& meta);
+  void save();
+private:
+  std::string filename_;
+  std::map<std::string, FileMeta> entries_;
+  bool dirty_;
+};
+
+void MetaCache::load(const char* tree)
+{
+  char path[PATH_MAX];
+  std::string dir = cache_dir();
+  if (dir.empty() || !realpath(tree, path))
+    return;
+  char name[32];
+  snprintf(name, sizeof(name), "/tree-%016llx",
+           (unsigned long long)hash_bytes(path, strlen(path)));
+  filename_ = dir + name;
+
+  FILE* fp = fopen(filename_.c_str(), "r");
+  if (!fp)
+    return;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, fp)) > 0) {
+    unsigned long long hash, fsize;
+    long long mtime;
+    int off;
+    if (line[len - 1] != '\n' ||
+        sscanf(line, "%llx %llu %lld %n", &hash, &fsize, &mtime, &off) != 3)
+      continue;
+    FileMeta& meta = entries_[std::string(line + off, len - 1 - off)];
+    meta.hash = hash;
+    meta.size = fsize;
+    meta.mtime = mtime;
+  }
+  free(line);
+  fclose(fp);
+}
+
+// the cached hash, when size and mtime still match
+bool MetaCache::find(const std::string& path, const FileMeta& st, uint64_t* hash) const
+{
+  std::map<std::string, FileMeta>::const_iterator it = entries_.find(path);
+  if (it == entries_.end() || it->second.size != st.size || it->second.mtime != st.mtime)
+    return false;
+  *hash = it->second.hash;
+  return true;
+}
+
+void MetaCache::update(const std::string& path, const FileMeta& meta)
+{
+  if (path.find('\n') != std::string::npos)
+    return;
+  FileMeta& entry = entries_[path];
+  if (entry.size == meta.size && entry.mtime == meta.mtime && entry.hash == meta.hash)
+    return;
+  entry = meta;
+  dirty_ = true;
+}
+
+// written aside and renamed over, so that a reader never sees half of it
+void MetaCache::save()
+{
+  if (!dirty_ || filename_.empty())
+    return;
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+  std::string tmp = filename_ + suffix;
+  FILE* fp = fopen(tmp.c_str(), "w");
+  if (!fp)
+    return;
+  for (std::map<std::string, FileMeta>::iterator it = entries_.begin();
+       it != entries_.end(); it++)
+    fprintf(fp, "%016llx %llu %lld %s\n", (unsigned long long)it->second.hash,
+            (unsigned long long)it->second.size, (long long)it->second.mtime,
+            it->first.c_str());
+  if (fclose(fp) || rename(tmp.c_str(), filename_.c_str()))
+    unlink(tmp.c_str());
+  dirty_ = false;
+}
+
+// runs a task for each index 0 .. count-1 on threads of its own, in index
+// order and at most `ahead` indexes past the one the caller last waited
+// for; tasks must not throw.  Worker stats are added to the caller's
+// when the pool stops
+class OrderedPool
+{
+public:
+  typedef void (*task_t)(void* ctx, size_t i, int worker);
+  OrderedPool() : task_(NULL), ctx_(NULL), count_(0), ahead_(0),
+                  next_(0), taken_(0), stopping_(false) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&work_cond_, NULL);
+    pthread_cond_init(&done_cond_, NULL);
+  }
+  ~OrderedPool() {
+    stop();
+    pthread_cond_destroy(&done_cond_);
+    pthread_cond_destroy(&work_cond_);
+    pthread_mutex_destroy(&lock_);
+  }
+  int start(int threads, size_t count, size_t ahead, task_t task, void* ctx);
+  void wait(size_t i);
+  void stop();
+  int size() { return workers_.size(); }
+private:
+  struct Worker
+  {
+    OrderedPool* owner;
+    int id;
+    pthread_t thread;
+    Stats stats;
+  };
+  static void* worker_main(void* arg);
+  void work(Worker* worker);
+  task_t task_;
+  void* ctx_;
+  size_t count_;
+  size_t ahead_;
+  size_t next_;  // first index not waited for
+  size_t taken_; // next index for the workers
+  bool stopping_;
+  std::vector<char> done_;
+  std::vector<Worker*> workers_;
+  pthread_mutex_t lock_;
+  pthread_cond_t work_cond_;
+  pthread_cond_t done_cond_;
+};
+
+// the number of threads running, 0 when none could be started
+int OrderedPool::start(int threads, size_t count, size_t ahead, task_t task, void* ctx)
+{
+  task_ = task;
+  ctx_ = ctx;
+  count_ = count;
+  ahead_ = ahead;
+  done_.assign(count, 0);
+  for (int i = 0; i < threads; i++) {
+    Worker* worker = new Worker;
+    worker->owner = this;
+    worker->id = i;
+    memset(&worker->stats, 0, sizeof(worker->stats));
+    if (pthread_create(&worker->thread, NULL, worker_main, worker)) {
+      delete worker;
+      break;
+    }
+    workers_.push_back(worker);
+  }
+  return workers_.size();
+}
+
+void OrderedPool::stop()
+{
+  pthread_mutex_lock(&lock_);
+  stopping_ = true;
+  pthread_cond_broadcast(&work_cond_);
+  pthread_mutex_unlock(&lock_);
+  for (size_t i = 0; i < workers_.size(); i++) {
+    pthread_join(workers_[i]->thread, NULL);
+    add_stats(workers_[i]->stats);
+    delete workers_[i];
+  }
+  workers_.clear();
+}
+
+void* OrderedPool::worker_main(void* arg)
+{
+  Worker* worker = (Worker*)arg;
+  if (trace_enabled) trace_thread("analyzer");
+  worker->owner->work(worker);
+  worker->stats = stats;
+  return NULL;
+}
+
+void OrderedPool::work(Worker* worker)
+{
+  pthread_mutex_lock(&lock_);
+  while (1) {
+    while (!stopping_ && taken_ < count_ && taken_ >= next_ + ahead_)
+      pthread_cond_wait(&work_cond_, &lock_);
+    if (stopping_ || taken_ >= count_)
+      break;
+    size_t i = taken_++;
+    pthread_mutex_unlock(&lock_);
+    task_(ctx_, i, worker->id);
+    pthread_mutex_lock(&lock_);
+    done_[i] = 1;
+    pthread_cond_broadcast(&done_cond_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+// blocks until task i is done and lets the workers move past it
+void OrderedPool::wait(size_t i)
+{
+  pthread_mutex_lock(&lock_);
+  if (next_ < i + 1) {
+    next_ = i + 1;
+    pthread_cond_broadcast(&work_cond_);
+  }
+  while (!done_[i])
+    pthread_cond_wait(&done_cond_, &lock_);
+  pthread_mutex_unlock(&lock_);
+}
+
+// compares the regular files found under both old_dir and the current
+// directory, recursively, as "diff -r old_dir ." pairs them, without
+// leaving the process.  Files of the same size whose contents hash
+// equal are skipped before any line is split; with threads > 1 the
+// comparisons run ahead of getsrc() on a pool of their own
+class DirAnalyzer : public Analyzer
+{
+public:
+  DirAnalyzer(const char* old_dir, int encoding = ENCODING_UNKNOWN,
+              int threads = 1, bool cache = true);
+  ~DirAnalyzer();
+  virtual const char* getsrc();
+  virtual Diff* getdiff();
+  void set_encoding(int encoding) { normalize_ = normalizer(encoding); }
+  size_t files() { return files_.size(); }
+  std::string old_path(size_t i) { return old_dir_ + "/" + files_[i]; }
+  const char* new_path(size_t i) { return files_[i].c_str(); }
+  void keep_only(const std::set<std::string>& paths);
+private:
+  struct Result
+  {
+    Result() : arena(NULL), hashed(false), failed(false) {}
+    std::list<Diff*> diffs;
+    Arena* arena;
+    FileMeta s_meta;
+    FileMeta d_meta;
+    bool hashed;
+    bool failed;
+    AppException error;
+  };
+  // scratch state of one thread
+  struct Worker
+  {
+    LineTable table;
+    DiffEngine engine;
+    std::string expanded;
+  };
+  void walk(const std::string& rel);
+  bool list(const std::string& dir, std::vector<std::string>* names,
+            std::vector<unsigned char>* types);
+  unsigned char filetype(const std::string& path, unsigned char type);
+  static void task(void* ctx, size_t i, int worker);
+  void compare(size_t i, Worker* worker);
+  void addlines(Line* line, const std::vector<StrRef>& lines, lno_t s, lno_t e,
+                Worker* worker);
+  normalize_t normalize_;
+  std::string old_dir_;
+  std::vector<std::string> files_;
+  std::vector<Result> results_;
+  size_t next_; // next file for getsrc()
+  std::list<Diff*> diffs_;
+  int threads_;
+  bool started_;
+  std::vector<Worker*> workers_;
+  OrderedPool pool_;
+  bool cache_;
+  MetaCache s_cache_;
+  MetaCache d_cache_;
 };
 
-int Writer::init(int colum)
+DirAnalyzer::DirAnalyzer(const char* old_dir, int encoding, int threads, bool cache)
+  : normalize_(normalizer(encoding)), old_dir_(old_dir), next_(0),
+    threads_(threads), started_(false), cache_(cache)
+{
+  walk("");
+  results_.resize(files_.size());
+  if (cache_) {
+    s_cache_.load(old_dir);
+    d_cache_.load(".");
+  }
+}
+
+DirAnalyzer::~DirAnalyzer()
+{
+  pool_.stop();
+  for (size_t i = 0; i < workers_.size(); i++)
+    delete workers_[i];
+  for (size_t i = 0; i < results_.size(); i++) {
+    for (std::list<Diff*>::iterator it = results_[i].diffs.begin();
+         it != results_[i].diffs.end(); it++)
+      delete *it;
+    delete results_[i].arena;
+  }
+  for (std::list<Diff*>::iterator it = diffs_.begin(); it != diffs_.end(); it++)
+    delete *it;
+  if (cache_) {
+    for (size_t i = 0; i < results_.size(); i++) {
+      if (results_[i].hashed) {
+        s_cache_.update(files_[i], results_[i].s_meta);
+        d_cache_.update(files_[i], results_[i].d_meta);
+      }
+    }
+    s_cache_.save();
+    d_cache_.save();
+  }
+}
+
+// narrows the comparison to the files listed, before the first getsrc()
+void DirAnalyzer::keep_only(const std::set<std::string>& paths)
+{
+  std::vector<std::string> files;
+  for (size_t i = 0; i < files_.size(); i++)
+    if (paths.count(files_[i]))
+      files.push_back(files_[i]);
+  files_.swap(files);
+  results_.clear();
+  results_.resize(files_.size());
+}
+
+// entry names of a directory, sorted, with their d_type
+bool DirAnalyzer::list(const std::string& dir, std::vector<std::string>* names,
+                       std::vector<unsigned char>* types)
+{
+  DIR* dp = opendir(dir.c_str());
+  if (!dp)
+    return false;
+  std::vector<std::pair<std::string, unsigned char> > ents;
+  while (struct dirent* ent = readdir(dp)) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+    ents.push_back(std::make_pair(std::string(ent->d_name), ent->d_type));
+  }
+  closedir(dp);
+  std::sort(ents.begin(), ents.end());
+  for (size_t i = 0; i < ents.size(); i++) {
+    names->push_back(ents[i].first);
+    types->push_back(ents[i].second);
+  }
+  return true;
+}
+
+// symbolic links are followed as diff does; stat() only when d_type
+// does not already tell
+unsigned char DirAnalyzer::filetype(const std::string& path, unsigned char type)
+{
+  if (type == DT_REG || type == DT_DIR)
+    return type;
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return DT_UNKNOWN;
+  if (S_ISREG(st.st_mode)) return DT_REG;
+  if (S_ISDIR(st.st_mode)) return DT_DIR;
+  return DT_UNKNOWN;
+}
+
+// pairs the names found on both sides, in the order diff -r reports them
+void DirAnalyzer::walk(const std::string& rel)
+{
+  std::string s_dir = rel.empty() ? old_dir_ : old_dir_ + "/" + rel;
+  std::string d_dir = rel.empty() ? std::string(".") : rel;
+  std::vector<std::string> s_names, d_names;
+  std::vector<unsigned char> s_types, d_types;
+  if (!list(s_dir, &s_names, &s_types)) {
+    if (rel.empty())
+      THROW_EXCEPTION("opendir(%s) %s", s_dir.c_str(), strerror(errno));
+    return;
+  }
+  if (!list(d_dir, &d_names, &d_types))
+    return;
+
+  size_t i = 0, j = 0;
+  while (i < s_names.size() && j < d_names.size()) {
+    int cmp = s_names[i].compare(d_names[j]);
+    if (cmp < 0) { i++; continue; }
+    if (cmp > 0) { j++; continue; }
+    std::string path = rel.empty() ? s_names[i] : rel + "/" + s_names[i];
+    unsigned char s_type = filetype(s_dir + "/" + s_names[i], s_types[i]);
+    unsigned char d_type = filetype(path, d_types[j]);
+    if (s_type == DT_REG && d_type == DT_REG)
+      files_.push_back(path);
+    else if (s_type == DT_DIR && d_type == DT_DIR)
+      walk(path);
+    i++;
+    j++;
+  }
+}
+
+void DirAnalyzer::task(void* ctx, size_t i, int worker)
+{
+  DirAnalyzer* self = (DirAnalyzer*)ctx;
+  Stage stage(STAGE_PARSE);
+  trace_file(self->new_path(i));
+  Span span("compare");
+  try {
+    self->compare(i, self->workers_[worker]);
+  } catch (AppException& e) {
+    self->results_[i].failed = true;
+    self->results_[i].error = e;
+  }
+}
+
+// the next file that differs, with all of its hunks queued
+const char* DirAnalyzer::getsrc()
+{
+  if (!started_) {
+    // files are compared at most DIR_FILES_PER_THREAD per thread ahead
+    started_ = true;
+    for (int i = 0; i < std::max(threads_, 1); i++)
+      workers_.push_back(new Worker);
+    if (threads_ > 1 && files_.size() > 1)
+      pool_.start(threads_, files_.size(), threads_ * DIR_FILES_PER_THREAD, task, this);
+  }
+  while (next_ < files_.size()) {
+    size_t i = next_++;
+    Result& r = results_[i];
+    if (pool_.size()) {
+      pool_.wait(i);
+      if (r.failed)
+        throw r.error;
+    } else {
+      compare(i, workers_[0]);
+    }
+    if (!r.diffs.empty()) {
+      diffs_.swap(r.diffs);
+      delete arena_;
+      arena_ = r.arena;
+      r.arena = NULL;
+      return files_[i].c_str();
+    }
+  }
+  return NULL;
+}
+
+Diff* DirAnalyzer::getdiff()
+{
+  if (diffs_.empty())
+    return NULL;
+  Diff* diff = diffs_.front();
+  diffs_.pop_front();
+  return diff;
+}
+
+void DirAnalyzer::addlines(Line* line, const std::vector<StrRef>& lines, lno_t s, lno_t e,
+                           Worker* worker)
+{
+  for (lno_t i = s; i < e; i++)
+    line->addstr(normalize_(lines[i].ptr, lines[i].len, &worker->expanded));
+}
+
+// lines of a mapped file, the LF kept
+static void split_lines(const char* p, size_t size, std::vector<StrRef>* lines)
+{
+  const char* end = p + size;
+  while (p != end) {
+    const char* lf = (const char*)memchr(p, '\n', end - p);
+    const char* next = lf ? lf + 1 : end;
+    lines->push_back(StrRef(p, next - p));
+    p = next;
+  }
+}
+
+static bool is_binary(const char* p, size_t size)
+{
+  return memchr(p, 0, size < DIFF_BINARY_SAMPLE ? size : DIFF_BINARY_SAMPLE) != NULL;
+}
+
+void DirAnalyzer::compare(size_t n, Worker* worker)
+{
+  Result& r = results_[n];
+  std::string s_name = old_path(n);
+  const char* d_name = new_path(n);
+  struct stat s_st, d_st;
+  if (stat(s_name.c_str(), &s_st) < 0)
+    THROW_EXCEPTION("stat(%s) %s", s_name.c_str(), strerror(errno));
+  if (stat(d_name, &d_st) < 0)
+    THROW_EXCEPTION("stat(%s) %s", d_name, strerror(errno));
+  r.s_meta = FileMeta(s_st);
+  r.d_meta = FileMeta(d_st);
+
+  // same size: equal hashes, cached or taken now, mean equal files
+  bool same_size = r.s_meta.size == r.d_meta.size;
+  bool s_known = false, d_known = false;
+  if (same_size && cache_) {
+    s_known = s_cache_.find(files_[n], r.s_meta, &r.s_meta.hash);
+    d_known = d_cache_.find(files_[n], r.d_meta, &r.d_meta.hash);
+    if (s_known && d_known && r.s_meta.hash == r.d_meta.hash) {
+      r.hashed = true;
+      return;
+    }
+  }
+
+  size_t s_size = 0, d_size = 0;
+  const char* s_map = map_file(s_name.c_str(), &s_size);
+  const char* d_map = NULL;
+  try {
+    d_map = map_file(d_name, &d_size);
+  } catch (AppException&) {
+    if (s_map) munmap((void*)s_map, s_size);
+    throw;
+  }
+  if (same_size && s_size == d_size) {
+    if (!s_known) r.s_meta.hash = hash_bytes(s_map, s_size);
+    if (!d_known) r.d_meta.hash = hash_bytes(d_map, d_size);
+    r.hashed = true;
+  }
+
+  if (!(r.hashed && r.s_meta.hash == r.d_meta.hash) &&
+      !is_binary(s_map, s_size) && !is_binary(d_map, d_size)) {
+    std::vector<StrRef> src, dst;
+    split_lines(s_map, s_size, &src);
+    split_lines(d_map, d_size, &dst);
+    worker->table.reset(src.size() + dst.size());
+    std::vector<int> a(src.size()), b(dst.size());
+    for (size_t i = 0; i < src.size(); i++) a[i] = worker->table.id(src[i]);
+    for (size_t j = 0; j < dst.size(); j++) b[j] = worker->table.id(dst[j]);
+    DiffEngine& engine = worker->engine;
+    engine.compare(a, b, worker->table.count());
+
+    // a hunk is a run of changed lines on either side between equal ones
+    lno_t i = 0, j = 0, ni = a.size(), nj = b.size();
+    while (i < ni || j < nj) {
+      if ((i < ni && engine.src_changed(i)) || (j < nj && engine.dst_changed(j))) {
+        lno_t si = i, sj = j;
+        while (i < ni && engine.src_changed(i)) i++;
+        while (j < nj && engine.dst_changed(j)) j++;
+        if (!r.arena) r.arena = new Arena(budget_);
+        Diff* diff = new Diff(r.arena, (si == i) ? MODE_ADD : (sj == j) ? MODE_DEL : MODE_MOD);
+        if (si < i) addlines(diff->add_src(si + 1, i), src, si, i, worker);
+        if (sj < j) addlines(diff->add_dst(sj + 1, j), dst, sj, j, worker);
+        r.diffs.push_back(diff);
+      } else {
+        i++;
+        j++;
+      }
+    }
+  }
+  if (s_map) munmap((void*)s_map, s_size);
+  if (d_map) munmap((void*)d_map, d_size);
+}
+
+// set by SIGINT or SIGTERM to end --watch
+static volatile sig_atomic_t watch_stop;
+
+static void watch_signal(int)
+{
+  watch_stop = 1;
+}
+
+// every directory of both trees of -d under inotify.  wait() blocks for
+// a burst of events, reads on until they settle for WATCH_SETTLE_MSEC and
+// returns the file paths they named, relative to either tree
+class TreeWatcher
+{
+public:
+  TreeWatcher(const char* old_dir);
+  ~TreeWatcher() { close(fd_); }
+  // false once --watch is to end; all when the events overflowed
+  bool wait(std::set<std::string>* paths, bool* all);
+private:
+  void add_tree(const std::string& root, const std::string& rel);
+  void rewatch();
+  void read_events(std::set<std::string>* paths, bool* all);
+  int fd_;
+  std::string old_dir_;
+  std::map<int, std::string> dirs_; // watch descriptor to relative path
+  bool rewatch_; // a directory came or went
+};
+
+TreeWatcher::TreeWatcher(const char* old_dir) : old_dir_(old_dir), rewatch_(false)
+{
+  if ((fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    THROW_EXCEPTION("inotify_init1() %s", strerror(errno));
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  rewatch();
+}
+
+void TreeWatcher::add_tree(const std::string& root, const std::string& rel)
+{
+  std::string dir = rel.empty() ? root : root + "/" + rel;
+  int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd < 0) {
+    if (rel.empty())
+      THROW_EXCEPTION("inotify_add_watch(%s) %s", dir.c_str(), strerror(errno));
+    return;
+  }
+  dirs_[wd] = rel;
+  DIR* dp = opendir(dir.c_str());
+  if (!dp)
+    return;
+  std::vector<std::string> subdirs;
+  while (struct dirent* ent = readdir(dp)) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+    std::string path = rel.empty() ? std::string(ent->d_name) : rel + "/" + ent->d_name;
+    struct stat st;
+    if (ent->d_type == DT_DIR ||
+        (ent->d_type == DT_UNKNOWN && stat((root + "/" + path).c_str(), &st) == 0 &&
+         S_ISDIR(st.st_mode)))
+      subdirs.push_back(path);
+  }
+  closedir(dp);
+  for (size_t i = 0; i < subdirs.size(); i++)
+    add_tree(root, subdirs[i]);
+}
+
+// watches made afresh, as moved directories leave stale paths behind
+void TreeWatcher::rewatch()
+{
+  for (std::map<int, std::string>::iterator it = dirs_.begin(); it != dirs_.end(); it++)
+    inotify_rm_watch(fd_, it->first);
+  dirs_.clear();
+  add_tree(old_dir_, "");
+  add_tree(".", "");
+  rewatch_ = false;
+}
+
+void TreeWatcher::read_events(std::set<std::string>* paths, bool* all)
+{
+  char buf[WATCH_EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    ssize_t n = read(fd_, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return;
+      THROW_EXCEPTION("read(inotify) %s", strerror(errno));
+    }
+    for (char* p = buf; p < buf + n; ) {
+      struct inotify_event* ev = (struct inotify_event*)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        *all = true;
+        rewatch_ = true;
+        continue;
+      }
+      std::map<int, std::string>::iterator it = dirs_.find(ev->wd);
+      if (it == dirs_.end())
+        continue;
+      if (ev->mask & IN_IGNORED) {
+        dirs_.erase(it);
+        continue;
+      }
+      if (!ev->len)
+        continue;
+      if (ev->mask & IN_ISDIR)
+        rewatch_ = true;
+      else
+        paths->insert(it->second.empty() ? std::string(ev->name)
+                                         : it->second + "/" + ev->name);
+    }
+  }
+}
+
+bool TreeWatcher::wait(std::set<std::string>* paths, bool* all)
+{
+  paths->clear();
+  *all = false;
+  struct pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  int timeout = -1;
+  while (!watch_stop) {
+    int n = poll(&pfd, 1, timeout);
+    if (n < 0 && errno != EINTR)
+      THROW_EXCEPTION("poll() %s", strerror(errno));
+    if (n > 0) {
+      read_events(paths, all);
+      timeout = WATCH_SETTLE_MSEC;
+    } else if (n == 0) {
+      if (rewatch_) rewatch();
+      return true;
+    }
+  }
+  return false;
+}
+
+// parses a mapped patch on several threads.  A pre-pass cuts it at file
+// boundaries (the lines parse_filename() knows) into sections of about
+// the same size, each section is parsed by its own analyzer of the same
+// format, and the files are handed out in patch order
+class SplitAnalyzer : public Analyzer
+{
+public:
+  static Analyzer* create(Analyzer* like, const char* difftext, int encoding, int threads);
+  ~SplitAnalyzer();
+  virtual const char* getsrc();
+  virtual Diff* getdiff();
+private:
+  struct File
+  {
+    std::string name;
+    std::vector<Diff*> diffs;
+    Arena* arena;
+  };
+  struct Section
+  {
+    Section(size_t o, size_t l) : off(o), len(l), failed(false) {}
+    size_t off;
+    size_t len;
+    std::vector<File*> files;
+    bool failed;
+    AppException error;
+  };
+  SplitAnalyzer(Analyzer* like, const char* map, size_t size, int encoding, int threads);
+  void split();
+  static void task(void* ctx, size_t i, int worker);
+  void parse(Section* section);
+  Analyzer* like_;
+  const char* map_;
+  size_t size_;
+  int encoding_;
+  int threads_;
+  std::vector<Section> sections_;
+  size_t section_; // section and file of the last getsrc()
+  size_t file_;
+  size_t diff_;
+  bool started_;
+  OrderedPool pool_;
+};
+
+// the analyzer given when the patch is too small to be worth splitting
+// or cannot be mapped
+Analyzer* SplitAnalyzer::create(Analyzer* like, const char* difftext, int encoding, int threads)
+{
+  struct stat st;
+  if (threads <= 1 || stat(difftext, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < SPLIT_MIN_SIZE)
+    return like;
+  size_t size;
+  const char* map = map_file(difftext, &size);
+  return new SplitAnalyzer(like, map, size, encoding, threads);
+}
+
+SplitAnalyzer::SplitAnalyzer(Analyzer* like, const char* map, size_t size,
+                             int encoding, int threads)
+  : like_(like), map_(map), size_(size), encoding_(encoding), threads_(threads),
+    section_(0), file_(0), diff_(0), started_(false)
+{
+  split();
+}
+
+SplitAnalyzer::~SplitAnalyzer()
+{
+  pool_.stop();
+  for (size_t i = 0; i < sections_.size(); i++) {
+    for (size_t j = 0; j < sections_[i].files.size(); j++) {
+      File* file = sections_[i].files[j];
+      for (size_t k = 0; k < file->diffs.size(); k++)
+        delete file->diffs[k];
+      delete file->arena;
+      delete file;
+    }
+  }
+  delete like_;
+  munmap((void*)map_, size_);
+}
+
+// each cut is the first file boundary past an even share of the bytes
+void SplitAnalyzer::split()
+{
+  size_t share = std::max(size_ / (threads_ * SPLIT_SECTIONS_PER_THREAD),
+                          (size_t)SPLIT_MIN_SIZE / 4);
+  size_t off = 0;
+  while (off < size_) {
+    size_t cut = size_;
+    if (off + share < size_) {
+      const char* p = (const char*)memchr(map_ + off + share, '\n', size_ - off - share);
+      while (p && ++p != map_ + size_) {
+        const char* lf = (const char*)memchr(p, '\n', map_ + size_ - p);
+        StrRef line(p, (lf ? lf : map_ + size_) - p);
+        if (parse_filename(line).ptr) {
+          cut = p - map_;
+          break;
+        }
+        p = lf;
+      }
+    }
+    sections_.push_back(Section(off, cut - off));
+    off = cut;
+  }
+}
+
+void SplitAnalyzer::task(void* ctx, size_t i, int)
+{
+  SplitAnalyzer* self = (SplitAnalyzer*)ctx;
+  Section* section = &self->sections_[i];
+  Stage stage(STAGE_PARSE);
+  Span span("section");
+  try {
+    self->parse(section);
+  } catch (AppException& e) {
+    section->failed = true;
+    section->error = e;
+  }
+}
+
+void SplitAnalyzer::parse(Section* section)
+{
+  FILE* fp = fmemopen((void*)(map_ + section->off), section->len, "r");
+  if (!fp)
+    THROW_EXCEPTION("fmemopen() %s", strerror(errno));
+  Analyzer* analyzer = NULL;
+  try {
+    analyzer = like_->another(new Reader(fp, encoding_));
+    analyzer->set_budget(budget_);
+    while (const char* name = analyzer->getsrc()) {
+      File* file = new File;
+      file->name = name;
+      section->files.push_back(file);
+      while (Diff* diff = analyzer->getdiff())
+        file->diffs.push_back(diff);
+      file->arena = analyzer->take_arena();
+    }
+  } catch (AppException&) {
+    delete analyzer;
+    fclose(fp);
+    throw;
+  }
+  delete analyzer;
+  fclose(fp);
+}
+
+const char* SplitAnalyzer::getsrc()
+{
+  if (!started_) {
+    started_ = true;
+    pool_.start(threads_, sections_.size(), threads_ * SPLIT_SECTIONS_PER_THREAD, task, this);
+    if (!pool_.size())
+      THROW_EXCEPTION("pthread_create() failed");
+    pool_.wait(0);
+    file_ = 0;
+  } else {
+    file_++;
+  }
+  while (section_ < sections_.size()) {
+    Section& section = sections_[section_];
+    if (section.failed)
+      throw section.error;
+    if (file_ < section.files.size()) {
+      File* file = section.files[file_];
+      delete arena_;
+      arena_ = file->arena;
+      file->arena = NULL;
+      diff_ = 0;
+      return file->name.c_str();
+    }
+    if (++section_ < sections_.size())
+      pool_.wait(section_);
+    file_ = 0;
+  }
+  return NULL;
+}
+
+Diff* SplitAnalyzer::getdiff()
+{
+  File* file = sections_[section_].files[file_];
+  if (diff_ == file->diffs.size())
+    return NULL;
+  Diff* diff = file->diffs[diff_];
+  file->diffs[diff_++] = NULL;
+  return diff;
+}
+
+// picks the encoding of the run once, from a bounded sample of the diff
+// and the source files it names; ASCII runs are skipped a vector at a
+// time and each remaining candidate validates the multibyte sequences
+class EncodingDetector
+{
+public:
+  EncodingDetector()
+    : candidates_(ENCODING_UTF8 | ENCODING_SJIS | ENCODING_EUC),
+      bytes_(0), multibyte_(false) {}
+  void feed(StrRef text);
+  void feed_diff(StrRef text);
+  void feed_file(const char* filename, size_t max, bool diff = false);
+  int result();
+  long bytes() { return bytes_; }
+private:
+  bool valid_utf8(const unsigned char* in, const unsigned char* end);
+  bool valid_sjis(const unsigned char* in, const unsigned char* end);
+  bool valid_euc(const unsigned char* in, const unsigned char* end);
+  int candidates_;
+  long bytes_;
+  bool multibyte_;
+  std::vector<std::string> sources_;
+};
+
+// a sequence cut short by the end of the sample is not held against it
+bool EncodingDetector::valid_utf8(const unsigned char* in, const unsigned char* end)
+{
+  uint32_t cp;
+  while ((in += ascii_span(in, end - in)) != end) {
+    int n = utf8_decode(in, end - in, &cp);
+    if (!n) {
+      int len = byte_class[*in] & BC_UTF8_LEN;
+      return len >= 2 && end - in < len;
+    }
+    in += n;
+  }
+  return true;
+}
+
+bool EncodingDetector::valid_sjis(const unsigned char* in, const unsigned char* end)
+{
+  while ((in += ascii_span(in, end - in)) != end) {
+    if (byte_class[*in] & BC_KANA)
+      in += 1;
+    else if (sjis_zenkaku(in, end - in))
+      in += 2;
+    else
+      return (byte_class[*in] & BC_SJIS_LEAD) && end - in == 1;
+  }
+  return true;
+}
+
+bool EncodingDetector::valid_euc(const unsigned char* in, const unsigned char* end)
+{
+  while ((in += ascii_span(in, end - in)) != end) {
+    if (euc_hankana(in, end - in) || euc_zenkaku(in, end - in))
+      in += 2;
+    else if (*in == 0x8F && euc_zenkaku(in + 1, end - in - 1))
+      in += 3;
+    else
+      return end - in < 3 && (*in == 0x8E || *in == 0x8F ||
+                              (byte_class[*in] & BC_EUC));
+  }
+  return true;
+}
+
+void EncodingDetector::feed(StrRef text)
+{
+  const unsigned char* in = (const unsigned char*)text.ptr;
+  const unsigned char* end = in + text.len;
+  bytes_ += text.len;
+  in += ascii_span(in, end - in);
+  if (in == end)
+    return;
+  multibyte_ = true;
+  if ((candidates_ & ENCODING_UTF8) && !valid_utf8(in, end))
+    candidates_ &= ~ENCODING_UTF8;
+  if ((candidates_ & ENCODING_SJIS) && !valid_sjis(in, end))
+    candidates_ &= ~ENCODING_SJIS;
+  if ((candidates_ & ENCODING_EUC) && !valid_euc(in, end))
+    candidates_ &= ~ENCODING_EUC;
+}
+
+// diff text also names the source files to sample
+void EncodingDetector::feed_diff(StrRef text)
+{
+  feed(text);
+  const char* p = text.ptr;
+  const char* end = text.ptr + text.len;
+  while (p != end && sources_.size() < DETECT_SOURCE_FILES) {
+    const char* lf = (const char*)memchr(p, '\n', end - p);
+    StrRef line(p, cutLF(p, (lf ? lf + 1 : end) - p));
+    StrRef name = Analyzer::parse_filename(line);
+    if (name.ptr) {
+      name = trimspace(name);
+      std::string filename(name.ptr, name.len);
+      bool seen = false;
+      for (size_t i = 0; i < sources_.size(); i++)
+        if (sources_[i] == filename) seen = true;
+      if (!seen) {
+        sources_.push_back(filename);
+        feed_file(filename.c_str(), DETECT_SOURCE_SIZE);
+      }
+    }
+    p = lf ? lf + 1 : end;
+  }
+}
+
+void EncodingDetector::feed_file(const char* filename, size_t max, bool diff)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp)
+    return;
+  std::string buf(max, 0);
+  size_t n = fread(&buf[0], 1, max, fp);
+  fclose(fp);
+  if (diff)
+    feed_diff(StrRef(buf.data(), n));
+  else
+    feed(StrRef(buf.data(), n));
+}
+
+// a plain ASCII sample proves nothing and keeps guessing per character;
+// when the sample fits both Japanese encodings EUC wins, as SJIS text
+// rarely keeps to 0xA1-0xFE
+int EncodingDetector::result()
+{
+  if (!multibyte_)
+    return ENCODING_UNKNOWN;
+  if (candidates_ & ENCODING_UTF8)
+    return ENCODING_UTF8;
+  if (candidates_ & ENCODING_EUC)
+    return ENCODING_EUC;
+  if (candidates_ & ENCODING_SJIS)
+    return ENCODING_SJIS;
+  return ENCODING_UNKNOWN;
+}
+
+// output buffer owned by the caller: the Writer assembles rows in place
+// and they reach the file descriptor in blocks of the buffer size.
+// Without a descriptor (fd < 0) it only grows and keeps everything
+class OutBuf
+{
+public:
+  OutBuf(int fd = STDOUT_FILENO, size_t size = DEFAULT_OUTBUF_SIZE)
+    : fd_(fd), size_(size), used_(0) {
+    if (!(buf_ = (char*)malloc(size_)))
+      THROW_EXCEPTION("memory short");
+  }
+  ~OutBuf() {
+    try {
+      flush();
+    } catch (AppException& e) {
+      fprintf(stderr, "%s\n", e.what());
+    }
+    free(buf_);
+  }
+  char* reserve(size_t n);
+  void commit(char* end) { used_ = end - buf_; }
+  void write(const char* p, size_t n);
+  void flush();
+  void clear() { used_ = 0; }
+  const char* data() { return buf_; }
+  size_t size() { return used_; }
+private:
+  void write_all(const char* p, size_t n);
+  int fd_;
+  char* buf_;
+  size_t size_;
+  size_t used_;
+};
+
+// position with room for n more bytes; rows larger than the buffer grow it
+char* OutBuf::reserve(size_t n)
+{
+  if (used_ + n > size_) {
+    if (fd_ >= 0)
+      flush();
+    if (used_ + n > size_) {
+      size_t size = (fd_ >= 0) ? n : std::max(size_ * 2, used_ + n);
+      char* p = (char*)realloc(buf_, size);
+      if (!p) THROW_EXCEPTION("memory short");
+      buf_ = p;
+      size_ = size;
+    }
+  }
+  return buf_ + used_;
+}
+
+// blocks of a buffer's size or more bypass it
+void OutBuf::write(const char* p, size_t n)
+{
+  if (fd_ >= 0 && n >= size_) {
+    flush();
+    write_all(p, n);
+    return;
+  }
+  memcpy(reserve(n), p, n);
+  used_ += n;
+}
+
+void OutBuf::write_all(const char* p, size_t len)
+{
+  Stage stage(STAGE_WRITE);
+  Span span("flush");
+  stats.out_bytes += len;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::write(fd_, p + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      THROW_EXCEPTION("write() %s", strerror(errno));
+    }
+    done += n;
+  }
+}
+
+void OutBuf::flush()
+{
+  if (fd_ < 0)
+    return;
+  size_t used = used_;
+  used_ = 0;
+  write_all(buf_, used);
+}
+
+// rendered files kept in a directory of their own, one block per key,
+// for --render-cache.  A hit refreshes the block's mtime, and each block
+// put pushes out the least recently used ones until the cache fits in
+// its size.  Best effort like MetaCache: a block that cannot be read or
+// written is rendered as if never cached
+class RenderCache
+{
+public:
+  RenderCache(const char* dir, size_t limit);
+  ~RenderCache();
+  // appends the block of key to out
+  bool get(uint64_t key, OutBuf* out);
+  void put(uint64_t key, const char* p, size_t len);
+private:
+  struct Entry
+  {
+    size_t size;
+    int64_t used; // mtime, nsec
+  };
+  std::string path(uint64_t key);
+  void use(uint64_t key, Entry* entry, int64_t used);
+  void evict();
+  std::string dir_;
+  size_t limit_;
+  size_t size_;
+  std::map<uint64_t, Entry> entries_;
+  std::set<std::pair<int64_t, uint64_t> > lru_; // (used, key), oldest first
+  pthread_mutex_t lock_; // render workers share the cache
+};
+
+static int64_t now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+RenderCache::RenderCache(const char* dir, size_t limit)
+  : dir_(dir), limit_(limit), size_(0)
+{
+  pthread_mutex_init(&lock_, NULL);
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    THROW_EXCEPTION("mkdir(%s) %s", dir, strerror(errno));
+  DIR* dp = opendir(dir);
+  if (!dp)
+    THROW_EXCEPTION("opendir(%s) %s", dir, strerror(errno));
+  while (struct dirent* ent = readdir(dp)) {
+    char* end;
+    uint64_t key = strtoull(ent->d_name, &end, 16);
+    struct stat st;
+    if (end != ent->d_name + 16 || *end || stat(path(key).c_str(), &st) < 0)
+      continue;
+    Entry& entry = entries_[key];
+    entry.size = st.st_size;
+    use(key, &entry, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    size_ += entry.size;
+  }
+  closedir(dp);
+  evict();
+}
+
+RenderCache::~RenderCache()
+{
+  pthread_mutex_destroy(&lock_);
+}
+
+// entry moves to the young end of the LRU order; under lock_
+void RenderCache::use(uint64_t key, Entry* entry, int64_t used)
+{
+  lru_.erase(std::make_pair(entry->used, key));
+  entry->used = used;
+  lru_.insert(std::make_pair(used, key));
+}
+
+// the least recently used blocks go until the cache fits; under lock_.
+// A block that cannot be removed is forgotten all the same, so that one
+// unwritable file does not stop the rest from going
+void RenderCache::evict()
+{
+  while (size_ > limit_ && !lru_.empty()) {
+    uint64_t key = lru_.begin()->second;
+    lru_.erase(lru_.begin());
+    std::map<uint64_t, Entry>::iterator it = entries_.find(key);
+    if (unlink(path(key).c_str()) == 0 || errno == ENOENT)
+      stats.render_evicted += it->second.size;
+    size_ -= it->second.size;
+    entries_.erase(it);
+  }
+}
+
+std::string RenderCache::path(uint64_t key)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx", (unsigned long long)key);
+  return dir_ + name;
+}
+
+bool RenderCache::get(uint64_t key, OutBuf* out)
+{
+  pthread_mutex_lock(&lock_);
+  bool known = entries_.count(key);
+  pthread_mutex_unlock(&lock_);
+  if (!known)
+    return false;
+  int fd = open(path(key).c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok) {
+    // read() straight into the output, the one copy of a hit
+    size_t len = st.st_size, done = 0;
+    char* p = out->reserve(len);
+    while (done < len) {
+      ssize_t n = read(fd, p + done, len - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      done += n;
+    }
+    ok = done == len;
+    if (ok) {
+      out->commit(p + len);
+      futimens(fd, NULL);
+    }
+  }
+  close(fd);
+  if (ok) {
+    pthread_mutex_lock(&lock_);
+    std::map<uint64_t, Entry>::iterator it = entries_.find(key);
+    if (it != entries_.end())
+      use(key, &it->second, now_nsec());
+    pthread_mutex_unlock(&lock_);
+  }
+  return ok;
+}
+
+// written aside and renamed over, so that a reader never sees half of it
+void RenderCache::put(uint64_t key, const char* p, size_t len)
+{
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%d.%ld", (int)getpid(), (long)syscall(SYS_gettid));
+  std::string name = path(key);
+  std::string tmp = name + suffix;
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::write(fd, p + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  if (close(fd) || done != len || rename(tmp.c_str(), name.c_str())) {
+    unlink(tmp.c_str());
+    return;
+  }
+  pthread_mutex_lock(&lock_);
+  std::map<uint64_t, Entry>::iterator it = entries_.find(key);
+  if (it == entries_.end()) {
+    it = entries_.insert(std::make_pair(key, Entry())).first;
+    it->second.size = 0;
+    it->second.used = 0;
+  }
+  size_ -= it->second.size;
+  it->second.size = len;
+  size_ += len;
+  use(key, &it->second, now_nsec());
+  evict();
+  pthread_mutex_unlock(&lock_);
+}
+
+// digits of the line number, at least LNO_WIDTH
+inline int lno_width(lno_t lno)
+{
+  int width = 1;
+  for (; lno >= 10; lno /= 10)
+    width++;
+  return std::max(width, LNO_WIDTH);
+}
+
+// right aligned in width columns ("%*lld"), blank for 0
+inline char* put_lno(char* p, lno_t lno, int width)
+{
+  char digits[LNO_MAX_WIDTH];
+  int n = 0;
+  if (lno <= 0) {
+    memset(p, ' ', width);
+    return p + width;
+  }
+  do {
+    digits[n++] = '0' + lno % 10;
+    lno /= 10;
+  } while (lno);
+  for (int i = n; i < width; i++)
+    *p++ = ' ';
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+// copies a string literal, its length known at compile time
+template <size_t N>
+inline char* put(char* p, const char (&str)[N])
+{
+  memcpy(p, str, N - 1);
+  return p + N - 1;
+}
+
+// output backends, bound into Writer at compile time.  A backend puts the
+// fixed parts of a row around its two cells.  With COPY_CELLS the folded
+// text goes straight to the output, otherwise the backend is handed each
+// cell with its marks to rework; CELL_BYTES bounds the bytes it writes
+// per byte of text and ROW_BYTES those of the fixed parts
+#define BACKEND_PLAIN (0)
+#define BACKEND_ANSI  (1)
+#define BACKEND_HTML  (2)
+
+// "%5d %s |%c| %5d %s\n" rows, changed words marked on a row below
+struct PlainBackend
+{
+  enum { ID = BACKEND_PLAIN, COPY_CELLS = 1, MARKER_ROWS = 1, CELL_BYTES = 1, ROW_BYTES = 8 };
+  static void begin(OutBuf*, int) {}
+  static void end(OutBuf*) {}
+  static char* file_begin(char* p) { return p; }
+  static char* separator(char* p, int colum, int width) {
+    memset(p, '-', width + 1 + colum);
+    p = put(p + width + 1 + colum, "-+-+-");
+    memset(p, '-', width + 1 + colum);
+    p += width + 1 + colum;
+    *p++ = '\n';
+    return p;
+  }
+  static char* file_end(char* p) { return put(p, "\n\n"); }
+  static char* row_begin(char* p, char, lno_t lno, int width) {
+    p = put_lno(p, lno, width);
+    *p++ = ' ';
+    return p;
+  }
+  static char* row_middle(char* p, char mode, lno_t rno, int width) {
+    p = put(p, " |");
+    *p++ = mode;
+    p = put(p, "| ");
+    p = put_lno(p, rno, width);
+    *p++ = ' ';
+    return p;
+  }
+  static char* row_end(char* p, char) {
+    *p++ = '\n';
+    return p;
+  }
+  static char* cell(char* p, StrRef text, int pad, const char*) {
+    memcpy(p, text.ptr, text.len);
+    memset(p + text.len, ' ', pad);
+    return p + text.len + pad;
+  }
+};
+
+// plain rows coloured by mode for a terminal, changed words in reverse video
+struct AnsiBackend : public PlainBackend
+{
+  enum { ID = BACKEND_ANSI, COPY_CELLS = 0, MARKER_ROWS = 0, CELL_BYTES = 10, ROW_BYTES = 20 };
+  static const char* color(char mode) {
+    switch (mode) {
+    case MODE_ADD: return "\x1b[32m";
+    case MODE_DEL: return "\x1b[31m";
+    case MODE_MOD: return "\x1b[33m";
+    }
+    return NULL;
+  }
+  static char* row_begin(char* p, char mode, lno_t lno, int width) {
+    if (const char* c = color(mode)) {
+      memcpy(p, c, 5);
+      p += 5;
+    }
+    return PlainBackend::row_begin(p, mode, lno, width);
+  }
+  static char* row_end(char* p, char mode) {
+    if (color(mode)) p = put(p, "\x1b[0m");
+    *p++ = '\n';
+    return p;
+  }
+  static char* cell(char* p, StrRef text, int pad, const char* marks) {
+    if (!marks)
+      return PlainBackend::cell(p, text, pad, marks);
+    char on = 0;
+    for (size_t i = 0; i < text.len; i++) {
+      if (marks[i] != on) {
+        on = marks[i];
+        p = on ? put(p, "\x1b[7m") : put(p, "\x1b[27m");
+      }
+      *p++ = text.ptr[i];
+    }
+    if (on) p = put(p, "\x1b[27m");
+    memset(p, ' ', pad);
+    return p + pad;
+  }
+};
+
+// a page of one table per file, written as the rows come.  The text keeps
+// the encoding of the input, which the page declares when it is known;
+// '&', '<' and '>' never occur inside a SJIS or EUC character
+struct HtmlBackend
+{
+  enum { ID = BACKEND_HTML, COPY_CELLS = 0, MARKER_ROWS = 0, CELL_BYTES = 18, ROW_BYTES = 128 };
+  static void begin(OutBuf* out, int encoding);
+  static void end(OutBuf* out);
+  static char* file_begin(char* p) { return put(p, "<table>\n<thead>\n"); }
+  static char* separator(char* p, int, int) {
+    return put(p, "</thead>\n<tbody>\n");
+  }
+  static char* file_end(char* p) { return put(p, "</tbody>\n</table>\n"); }
+  static char* row_begin(char* p, char mode, lno_t lno, int width) {
+    p = put(p, "<tr class=\"");
+    *p++ = mode == MODE_EQL ? 'e' : mode - 'A' + 'a';
+    p = put(p, "\"><td class=\"n\">");
+    p = put_lno(p, lno, width);
+    return put(p, "</td><td>");
+  }
+  static char* row_middle(char* p, char mode, lno_t rno, int width) {
+    p = put(p, "</td><td class=\"m\">");
+    *p++ = mode;
+    p = put(p, "</td><td class=\"n\">");
+    p = put_lno(p, rno, width);
+    return put(p, "</td><td>");
+  }
+  static char* row_end(char* p, char) { return put(p, "</td></tr>\n"); }
+  static char* cell(char* p, StrRef text, int pad, const char* marks);
+};
+
+void HtmlBackend::begin(OutBuf* out, int encoding)
+{
+  std::string head("<!DOCTYPE html>\n<html>\n<head>\n");
+  switch (encoding) {
+  case ENCODING_UTF8: head.append("<meta charset=\"UTF-8\">\n"); break;
+  case ENCODING_SJIS: head.append("<meta charset=\"Shift_JIS\">\n"); break;
+  case ENCODING_EUC:  head.append("<meta charset=\"EUC-JP\">\n"); break;
+  }
+  head.append("<title>diffedit</title>\n"
+              "<style>\n"
+              "table { border-collapse: collapse; font-family: monospace; margin-bottom: 2em; }\n"
+              "td { white-space: pre; padding: 0 0.5em; vertical-align: top; }\n"
+              "thead td { font-weight: bold; border-bottom: 1px solid #888; }\n"
+              "td.n, td.m { color: #888; }\n"
+              "tr.a { background: #e6ffec; }\n"
+              "tr.d { background: #ffebe9; }\n"
+              "tr.m { background: #fff8c5; }\n"
+              "mark { background: #f2cc60; }\n"
+              "</style>\n"
+              "</head>\n"
+              "<body>\n");
+  out->write(head.data(), head.size());
+}
+
+void HtmlBackend::end(OutBuf* out)
+{
+  static const char tail[] = "</body>\n</html>\n";
+  out->write(tail, sizeof(tail) - 1);
+}
+
+// escaped text, marked bytes in <mark>; the padding is left to the table
+char* HtmlBackend::cell(char* p, StrRef text, int, const char* marks)
+{
+  char on = 0;
+  for (size_t i = 0; i < text.len; i++) {
+    if (marks && marks[i] != on) {
+      on = marks[i];
+      p = on ? put(p, "<mark>") : put(p, "</mark>");
+    }
+    switch (text.ptr[i]) {
+    case '&': p = put(p, "&amp;"); break;
+    case '<': p = put(p, "&lt;"); break;
+    case '>': p = put(p, "&gt;"); break;
+    default: *p++ = text.ptr[i]; break;
+    }
+  }
+  if (on) p = put(p, "</mark>");
+  return p;
+}
+
+template <class Enc, class Backend = PlainBackend>
+class Writer
+{
+public:
+  typedef Enc enc_t;
+  Writer(int colum, OutBuf* out)
+    : colum_(colum), lno_width_(LNO_WIDTH), out_(out),
+      row_(Backend::COPY_CELLS ? 0 : bufsize()) {}
+  ~Writer() {}
+  void header(const char* filename);
+  void format(lno_t lno, NormLine l, lno_t rno, NormLine r, char mode,
+              const char* l_marks = NULL, const char* r_marks = NULL);
+  void footer();
+  void skipped(lno_t lines);
+  // columns of the line numbers, for the file the next header opens
+  void set_lno_width(int width) { lno_width_ = std::min(width, LNO_MAX_WIDTH); }
+  int encoding() { return Enc::id; }
+  int backend() { return Backend::ID; }
+  int colum() { return colum_; }
+  OutBuf* out() { return out_; }
+  void set_out(OutBuf* out) { out_ = out; }
+private:
+  int bufsize() { return colum_ * UTF8_MAX_BYTES + 1; }
+  int rowsize() {
+    return 2 * (LNO_MAX_WIDTH + Backend::CELL_BYTES * bufsize()) + Backend::ROW_BYTES;
+  }
+  NormLine cell(NormLine line, const char* marks, char** out);
+  NormLine folding(const NormLine& in, char** out);
+  void marking(StrRef row, const char* marks, char** out);
+  void separator();
+  int colum_;
+  int lno_width_;
+  OutBuf* out_;
+  std::vector<char> row_; // a folded cell, for backends reworking it
+};
+
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::header(const char* filename)
+{
+  std::string l_line("org: ");
+  std::string r_line("new: ");
+  l_line.append(filename);
+  r_line.append(filename);
+  out_->commit(Backend::file_begin(out_->reserve(rowsize())));
+  format(0, NormLine(StrRef(l_line.data(), l_line.size()), -1),
+         0, NormLine(StrRef(r_line.data(), r_line.size()), -1), MODE_EQL);
+  separator();
+}
+
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::separator()
+{
+  out_->commit(Backend::separator(out_->reserve(rowsize()), colum_, lno_width_));
+}
+
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::footer()
+{
+  out_->commit(Backend::file_end(out_->reserve(rowsize())));
+}
+
+// a row is assembled straight into the output buffer.  With marks (one per
+// byte of the line, see IntraDiff) a backend with MARKER_ROWS follows each
+// row holding a changed byte with a row of '^' under the changed columns
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::format(lno_t lno, NormLine l, lno_t rno, NormLine r, char mode,
+                                  const char* l_marks, const char* r_marks)
+{
+  Stage stage(STAGE_FOLD);
+  const char* l_start = l.ptr;
+  const char* l_end = l.ptr + l.len;
+  const char* r_start = r.ptr;
+  const char* r_end = r.ptr + r.len;
+  while (l.ptr || r.ptr) {
+    StrRef l_row(l.ptr, 0);
+    StrRef r_row(r.ptr, 0);
+    char* p = out_->reserve(rowsize());
+    if (!l.ptr) lno = 0;
+    if (!r.ptr) rno = 0;
+
+    p = Backend::row_begin(p, mode, lno, lno_width_);
+    l = cell(l, l_marks && l.ptr ? l_marks + (l.ptr - l_start) : NULL, &p);
+    p = Backend::row_middle(p, mode, rno, lno_width_);
+    r = cell(r, r_marks && r.ptr ? r_marks + (r.ptr - r_start) : NULL, &p);
+    p = Backend::row_end(p, mode);
+    lno = rno = 0;
+
+    out_->commit(p);
+    stats.writer_rows++;
+
+    if (!Backend::MARKER_ROWS || (!l_marks && !r_marks)) continue;
+    if (l_row.ptr) l_row.len = (l.ptr ? l.ptr : l_end) - l_row.ptr;
+    if (r_row.ptr) r_row.len = (r.ptr ? r.ptr : r_end) - r_row.ptr;
+    const char* l_mark = l_marks && l_row.len ? l_marks + (l_row.ptr - l_start) : NULL;
+    const char* r_mark = r_marks && r_row.len ? r_marks + (r_row.ptr - r_start) : NULL;
+    if (!(l_mark && memchr(l_mark, 1, l_row.len)) &&
+        !(r_mark && memchr(r_mark, 1, r_row.len)))
+      continue;
+    p = out_->reserve(rowsize());
+    p = put_lno(p, 0, lno_width_);
+    *p++ = ' ';
+    marking(l_mark ? l_row : StrRef("", 0), l_mark, &p);
+    *p++ = ' ';
+    *p++ = '|';
+    *p++ = mode;
+    *p++ = '|';
+    *p++ = ' ';
+    p = put_lno(p, 0, lno_width_);
+    *p++ = ' ';
+    marking(r_mark ? r_row : StrRef("", 0), r_mark, &p);
+    *p++ = '\n';
+    out_->commit(p);
+    stats.writer_rows++;
+  }
+  return;
+}
+
+// one side of a row, folded to colum_ and blank when the line is absent.
+// The folded text goes to the output as is or through the backend's cell()
+template <class Enc, class Backend>
+NormLine Writer<Enc, Backend>::cell(NormLine line, const char* marks, char** pout)
+{
+  if (!line.ptr) {
+    line = NormLine(StrRef("", 0), 0);
+    marks = NULL;
+  }
+  if (Backend::COPY_CELLS)
+    return folding(line, pout);
+  char* row = &row_[0];
+  char* q = row;
+  NormLine rest = folding(line, &q);
+  size_t n = (rest.ptr ? rest.ptr : line.ptr + line.len) - line.ptr;
+  *pout = Backend::cell(*pout, StrRef(row, n), (q - row) - n, marks);
+  return rest;
+}
+
+// the columns taken by each character of a row folding() put out, as
+// '^' where any of its bytes is marked and blank otherwise
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::marking(StrRef row, const char* marks, char** pout)
+{
+  char* out = *pout;
+  int sz;
+  int col;
+  int colsum = 0;
+  const unsigned char* in = (const unsigned char*)row.ptr;
+  for (size_t i = 0; i < row.len; i += sz) {
+    size_t n = ascii_span(in + i, row.len - i);
+    for (size_t k = 0; k < n; k++)
+      out[k] = marks[i + k] ? '^' : ' ';
+    out += n;
+    colsum += n;
+    i += n;
+    if (i == row.len) break;
+    Enc::getcolumsz(in + i, row.len - i, &sz, &col);
+    memset(out, memchr(marks + i, 1, sz) ? '^' : ' ', col);
+    out += col;
+    colsum += col;
+  }
+  for (; colsum < colum_; colsum++)
+    *out++ = ' ';
+  *pout = out;
+}
+
+// the marker row standing for a run of equal lines not shown
+template <class Enc, class Backend>
+void Writer<Enc, Backend>::skipped(lno_t lines)
+{
+  char text[64];
+  int len = snprintf(text, sizeof(text), "... skipped %lld lines ...", (long long)lines);
+  NormLine line(StrRef(text, len), len);
+  format(0, line, 0, line, MODE_EQL);
+}
+
+// lines already measured by the normalize stage that fit are copied as is;
+// zero width characters may end a row early so that out never overflows
+template <class Enc, class Backend>
+NormLine Writer<Enc, Backend>::folding(const NormLine& line, char** pout)
+{
+  char* out = *pout;
+  char* limit = out + bufsize() - 1;
+  if (0 <= line.colums && line.colums <= colum_ &&
+      out + line.len + (colum_ - line.colums) <= limit) {
+    memcpy(out, line.ptr, line.len);
+    out += line.len;
+    memset(out, ' ', colum_ - line.colums);
+    *pout = out + (colum_ - line.colums);
+    stats.fold_measured++;
+    return NormLine();
+  }
+
+  int sz;
+  int col;
+  int colsum = 0;
+  unsigned char* in = (unsigned char*)line.ptr;
+  unsigned char* end = in + line.len;
+
+  while (in != end) {
+    size_t n = ascii_span(in, end - in);
+    if (n) {
+      bool full = n > (size_t)(colum_ - colsum);
+      if (full) n = colum_ - colsum;
+      memcpy(out, in, n);
+      in += n;
+      out += n;
+      colsum += n;
+      if (full) break;
+      if (in == end) break;
+    }
+    Enc::getcolumsz(in, end - in, &sz, &col);
+    if (colsum + col > colum_) break;
+    if (out + sz + (colum_ - colsum - col) > limit) break;
+    memcpy(out,in, sz);
+    in += sz;
+    out += sz;
+    colsum += col;
+  }
+  NormLine rest;
+  if (in != end) {
+    rest = NormLine(StrRef((const char*)in, end - in), -1);
+    if (line.colums >= 0) rest.colums = line.colums - colsum;
+  }
+  if (colsum < colum_)
+    for (; colsum != colum_; colsum++)
+      *out++ = ' ';
+  *pout = out;
+  stats.fold_scanned++;
+  return rest;
+}
+
+template <class W>
+class Printer
+{
+public:
+  Printer(Analyzer* analyzer, W* writer)
+    : analyzer_(analyzer), writer_(writer), source_(0), sno_(0), dno_(0),
+      context_(-1), hunks_(0), intra_(0), cache_(0), block_(-1, JOB_OUTBUF_SIZE) {}
+  ~Printer() {
+    delete analyzer_;
+    delete writer_;
+    delete intra_;
+  }
+  void print();
+  void render(const char* filename, std::vector<Diff*>* diffs);
+  // a file in parts: the header, sized from the hunks at hand, then the
+  // rest of its diffs as they come
+  void begin_file(const char* filename, std::vector<Diff*>* diffs);
+  void render_diffs(std::vector<Diff*>* diffs);
+  void end_file();
+  W* writer() { return writer_; }
+  // equal lines kept around each hunk, -1 for all of them
+  void set_context(int context) { context_ = context; }
+  // marks what changed within the lines of MODE_MOD rows
+  void set_intraline(bool on) {
+    delete intra_;
+    intra_ = on ? new IntraDiff<typename W::enc_t> : 0;
+  }
+  // files seen before are copied from the cache, not rendered; not owned
+  void set_cache(RenderCache* cache) { cache_ = cache; }
+private:
+  const char* parse_src() {
+    Stage stage(STAGE_PARSE);
+    Span span("getsrc");
+    const char* filename = analyzer_->getsrc();
+    if (filename) trace_file(filename);
+    return filename;
+  }
+  Diff* parse_diff() {
+    Stage stage(STAGE_PARSE);
+    Span span("getdiff");
+    return analyzer_->getdiff();
+  }
+  int lno_width(std::vector<Diff*>* diffs);
+  void print_equal_line(Diff* diff);
+  void print_equal(lno_t lines);
+  void skip(lno_t lines);
+  void print_diff_line(Diff* diff);
+  Source* source();
+  void print_final();
+  uint64_t cache_key(const char* filename, std::vector<Diff*>* diffs);
+  Analyzer* analyzer_;
+  W* writer_;
+  Source* source_;
+  const char* filename_;
+  lno_t sno_;
+  lno_t dno_;
+  int context_;
+  int hunks_; // hunks printed of the current file
+  IntraDiff<typename W::enc_t>* intra_;
+  RenderCache* cache_;
+  OutBuf block_; // a file rendered for the cache
+};
+
+// up to DIFF_BATCH_SIZE hunks of a file are parsed ahead of its header,
+// which takes the width of its line numbers from them; the rest are
+// printed as they are parsed.  The render cache keys on all of them
+template <class W>
+void Printer<W>::print()
+{
+  std::vector<Diff*> diffs;
+  while ((filename_ = parse_src())) {
+    while (Diff* diff = parse_diff()) {
+      diffs.push_back(diff);
+      if (!cache_ && diffs.size() == DIFF_BATCH_SIZE)
+        break;
+    }
+    if (diffs.size() < DIFF_BATCH_SIZE || cache_) {
+      render(filename_, &diffs);
+    } else {
+      begin_file(filename_, &diffs);
+      render_diffs(&diffs);
+      while (Diff* diff = parse_diff()) {
+        diffs.push_back(diff);
+        render_diffs(&diffs);
+      }
+      end_file();
+    }
+    analyzer_->arena()->clear();
+  }
+}
+
+// one file whose diffs were parsed ahead, as done by a render worker
+template <class W>
+void Printer<W>::render(const char* filename, std::vector<Diff*>* diffs)
+{
+  if (!cache_) {
+    begin_file(filename, diffs);
+    render_diffs(diffs);
+    end_file();
+    return;
+  }
+  uint64_t key = cache_key(filename, diffs);
+  OutBuf* out = writer_->out();
+  if (cache_->get(key, out)) {
+    trace_file(filename);
+    stats.files++;
+    stats.render_hits++;
+    for (size_t i = 0; i < diffs->size(); i++)
+      delete (*diffs)[i];
+    diffs->clear();
+    return;
+  }
+  stats.render_misses++;
+  block_.clear();
+  writer_->set_out(&block_);
+  try {
+    begin_file(filename, diffs);
+    render_diffs(diffs);
+    end_file();
+  } catch (AppException&) {
+    writer_->set_out(out);
+    throw;
+  }
+  writer_->set_out(out);
+  out->write(block_.data(), block_.size());
+  cache_->put(key, block_.data(), block_.size());
+}
+
+// everything a file's block depends on: its name, hunks and source, and
+// how the run renders them.  The source counts by its content, so a copy
+// of the tree or a fresh checkout hits the blocks of an earlier run
+template <class W>
+uint64_t Printer<W>::cache_key(const char* filename, std::vector<Diff*>* diffs)
+{
+  Stage stage(STAGE_PARSE);
+  size_t size;
+  const char* map = map_file(filename, &size);
+  uint64_t h = hash_bytes(map, size);
+  if (map) munmap((void*)map, size);
+  h = hash_mix(h, hash_bytes(filename, strlen(filename)));
+  h = hash_mix(h, diffs->size());
+  for (size_t i = 0; i < diffs->size(); i++)
+    h = (*diffs)[i]->hash(h);
+  h = hash_mix(h, hash_bytes(VERSION, strlen(VERSION)));
+  h = hash_mix(h, writer_->colum());
+  h = hash_mix(h, writer_->encoding());
+  h = hash_mix(h, writer_->backend());
+  h = hash_mix(h, TABSIZE);
+  h = hash_mix(h, context_);
+  return hash_mix(h, intra_ != 0);
+}
+
+// filename must stay valid until end_file()
+template <class W>
+void Printer<W>::begin_file(const char* filename, std::vector<Diff*>* diffs)
+{
+  filename_ = filename;
+  trace_file(filename);
+  writer_->set_lno_width(lno_width(diffs));
+  writer_->header(filename_);
+  stats.files++;
+}
+
+// the widest line number the rows will show, known before the first of
+// them.  sno/dno follow the steps of print_equal_line() and
+// print_diff_line() through the first DIFF_BATCH_SIZE hunks, all that a
+// streaming printer holds when the header goes out.  After them the equal
+// lines run on: to the end of the source, which is printed whole anyway
+// and so is counted, or for -U to context_ lines past the last hunk,
+// counted as far as that.  Only when more hunks follow under -U does the
+// source's size bound the line numbers without a pass over it.  The old
+// side may be ahead of the new one by as much as at the last hunk seen,
+// and a number that is wider still pushes its row to the right
+template <class W>
+int Printer<W>::lno_width(std::vector<Diff*>* diffs)
+{
+  size_t hunks = std::min(diffs->size(), (size_t)DIFF_BATCH_SIZE);
+  lno_t sno = 0, dno = 0, top = 0;
+  for (size_t i = 0; i < hunks; i++) {
+    Line* src = (*diffs)[i]->src();
+    Line* dst = (*diffs)[i]->dst();
+    lno_t s_l = src ? (src->start() - 1) - sno : 0;
+    lno_t d_l = dst ? (dst->start() - 1) - dno : 0;
+    lno_t e_l = (s_l > 0) ? ((d_l > 0) ? std::min(s_l, d_l) : s_l) : d_l;
+    if (e_l > 0) {
+      sno += e_l;
+      dno += e_l;
+    }
+    if (src) sno = std::max(src->start(), src->end());
+    if (dst) dno = std::max(dst->start(), dst->end());
+    top = std::max(top, std::max(sno, dno));
+  }
+  if (!hunks)
+    return ::lno_width(top);
+  if (context_ == 0 && diffs->size() < DIFF_BATCH_SIZE)
+    return ::lno_width(top);
+  try {
+    lno_t lines;
+    if (context_ < 0)
+      lines = source()->lines();
+    else if (diffs->size() < DIFF_BATCH_SIZE)
+      lines = source()->lines(dno + context_);
+    else
+      lines = source()->size();
+    top = std::max(top, lines + std::max(sno - dno, (lno_t)0));
+  } catch (AppException&) {
+    // no source: the rows fail on it later, as they always did
+  }
+  return ::lno_width(top);
+}
+
+template <class W>
+void Printer<W>::render_diffs(std::vector<Diff*>* diffs)
+{
+  for (size_t i = 0; i < diffs->size(); i++) {
+    Diff* diff = (*diffs)[i];
+    (*diffs)[i] = NULL;
+    print_equal_line(diff);
+    print_diff_line(diff);
+    delete diff;
+  }
+  diffs->clear();
+}
+
+template <class W>
+void Printer<W>::end_file()
+{
+  print_final();
+  writer_->footer();
+}
+
+// a file handed to the render pool: its diffs and, once rendered, its rows
+struct Job
+{
+  Job(const char* name, Arena* text)
+    : filename(name), arena(text), out(-1, JOB_OUTBUF_SIZE), done(false), failed(false) {}
+  ~Job() {
+    for (size_t i = 0; i < diffs.size(); i++)
+      delete diffs[i];
+    delete arena;
+  }
+  std::string filename;
+  std::vector<Diff*> diffs;
+  Arena* arena;
+  OutBuf out;
+  bool done;
+  bool failed;
+  AppException error;
+};
+
+// per-worker deque: the owner pops from the back, thieves take the front
+struct JobQueue
+{
+  JobQueue() { pthread_mutex_init(&lock, NULL); }
+  ~JobQueue() { pthread_mutex_destroy(&lock); }
+  Job* pop_back() {
+    Job* job = NULL;
+    pthread_mutex_lock(&lock);
+    if (!jobs.empty()) {
+      job = jobs.back();
+      jobs.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+    return job;
+  }
+  Job* pop_front() {
+    Job* job = NULL;
+    pthread_mutex_lock(&lock);
+    if (!jobs.empty()) {
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    pthread_mutex_unlock(&lock);
+    return job;
+  }
+  void push(Job* job) {
+    pthread_mutex_lock(&lock);
+    jobs.push_back(job);
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_mutex_t lock;
+  std::deque<Job*> jobs;
+};
+
+// the analyzer is read on the calling thread, file by file; the files are
+// rendered by a work-stealing pool and written out in the order parsed.
+// At most JOBS_PER_THREAD files per thread are in flight, so a long file
+// holds back the output but not the workers
+template <class W>
+class ParallelPrinter
+{
+public:
+  ParallelPrinter(Analyzer* analyzer, int colum, int context, bool intraline,
+                  RenderCache* cache, OutBuf* out, int threads);
+  ~ParallelPrinter();
+  void print();
+private:
+  struct Worker
+  {
+    ParallelPrinter* owner;
+    int id;
+    pthread_t thread;
+    JobQueue queue;
+    Printer<W>* printer;
+    Stats stats;
+  };
+  static void* worker_main(void* arg);
+  void work(Worker* worker);
+  Job* take(int id);
+  void submit(Job* job);
+  void emit();
+  void stop();
+  Analyzer* analyzer_;
+  OutBuf* out_;
+  std::vector<Worker*> workers_;
+  std::deque<Job*> inflight_;
+  int next_;
+  int pending_; // queued, not yet taken
+  bool stopping_;
+  pthread_mutex_t lock_;
+  pthread_cond_t work_cond_;
+  pthread_cond_t done_cond_;
+};
+
+template <class W>
+ParallelPrinter<W>::ParallelPrinter(Analyzer* analyzer, int colum, int context,
+                                    bool intraline, RenderCache* cache, OutBuf* out,
+                                    int threads)
+  : analyzer_(analyzer), out_(out), next_(0), pending_(0), stopping_(false)
+{
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  for (int i = 0; i < threads; i++) {
+    Worker* worker = new Worker;
+    worker->owner = this;
+    worker->id = i;
+    worker->printer = new Printer<W>(NULL, new W(colum, NULL));
+    worker->printer->set_context(context);
+    worker->printer->set_intraline(intraline);
+    worker->printer->set_cache(cache);
+    memset(&worker->stats, 0, sizeof(worker->stats));
+    workers_.push_back(worker);
+  }
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers_[i]->thread, NULL, worker_main, workers_[i])) {
+      workers_.resize(i);
+      stop();
+      THROW_EXCEPTION("pthread_create() failed");
+    }
+  }
+}
+
+template <class W>
+ParallelPrinter<W>::~ParallelPrinter()
+{
+  stop();
+  for (size_t i = 0; i < inflight_.size(); i++)
+    delete inflight_[i];
+  for (size_t i = 0; i < workers_.size(); i++) {
+    delete workers_[i]->printer;
+    delete workers_[i];
+  }
+  delete analyzer_;
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+template <class W>
+void ParallelPrinter<W>::stop()
+{
+  pthread_mutex_lock(&lock_);
+  bool running = !stopping_;
+  stopping_ = true;
+  pthread_cond_broadcast(&work_cond_);
+  pthread_mutex_unlock(&lock_);
+  if (!running)
+    return;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    pthread_join(workers_[i]->thread, NULL);
+    add_stats(workers_[i]->stats);
+  }
+}
+
+template <class W>
+void* ParallelPrinter<W>::worker_main(void* arg)
+{
+  Worker* worker = (Worker*)arg;
+  if (trace_enabled) trace_thread("render");
+  worker->owner->work(worker);
+  worker->stats = stats;
+  return NULL;
+}
+
+template <class W>
+void ParallelPrinter<W>::work(Worker* worker)
+{
+  while (Job* job = take(worker->id)) {
+    try {
+      worker->printer->writer()->set_out(&job->out);
+      worker->printer->render(job->filename.c_str(), &job->diffs);
+    } catch (AppException& e) {
+      job->failed = true;
+      job->error = e;
+    }
+    pthread_mutex_lock(&lock_);
+    job->done = true;
+    pthread_cond_broadcast(&done_cond_);
+    pthread_mutex_unlock(&lock_);
+  }
+}
+
+// own deque first, then steal; sleeps while nothing is queued anywhere
+template <class W>
+Job* ParallelPrinter<W>::take(int id)
+{
+  int n = workers_.size();
+  while (1) {
+    Job* job = workers_[id]->queue.pop_back();
+    for (int i = 1; !job && i < n; i++)
+      job = workers_[(id + i) % n]->queue.pop_front();
+    pthread_mutex_lock(&lock_);
+    if (job) {
+      pending_--;
+      pthread_mutex_unlock(&lock_);
+      return job;
+    }
+    while (!pending_ && !stopping_)
+      pthread_cond_wait(&work_cond_, &lock_);
+    bool done = !pending_ && stopping_;
+    pthread_mutex_unlock(&lock_);
+    if (done)
+      return NULL;
+  }
+}
+
+template <class W>
+void ParallelPrinter<W>::submit(Job* job)
+{
+  workers_[next_]->queue.push(job);
+  next_ = (next_ + 1) % workers_.size();
+  pthread_mutex_lock(&lock_);
+  pending_++;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&lock_);
+  inflight_.push_back(job);
+}
+
+// waits for the oldest file and writes it out
+template <class W>
+void ParallelPrinter<W>::emit()
+{
+  Job* job = inflight_.front();
+  pthread_mutex_lock(&lock_);
+  while (!job->done)
+    pthread_cond_wait(&done_cond_, &lock_);
+  pthread_mutex_unlock(&lock_);
+  inflight_.pop_front();
+  out_->write(job->out.data(), job->out.size());
+  if (job->failed) {
+    AppException e = job->error;
+    delete job;
+    throw e;
+  }
+  delete job;
+}
+
+template <class W>
+void ParallelPrinter<W>::print()
+{
+  size_t window = workers_.size() * JOBS_PER_THREAD;
+  while (1) {
+    const char* filename;
+    std::vector<Diff*> diffs;
+    {
+      Stage stage(STAGE_PARSE);
+      {
+        Span span("getsrc");
+        if (!(filename = analyzer_->getsrc()))
+          break;
+        trace_file(filename);
+      }
+      while (1) {
+        Span span("getdiff");
+        Diff* diff = analyzer_->getdiff();
+        if (!diff) break;
+        diffs.push_back(diff);
+      }
+    }
+    Job* job = new Job(filename, analyzer_->take_arena());
+    job->diffs.swap(diffs);
+    submit(job);
+    while (inflight_.size() >= window)
+      emit();
+  }
+  while (!inflight_.empty())
+    emit();
+  stop();
+}
+
+// a run of one file's diffs and the arena holding their text, handed
+// from the parser thread to the printer.  The first batch of a file
+// carries its name, the last one closes it
+struct DiffBatch
 {
-  int size = (colum / 2 * 3) + 1;
-  if (left_ = (char*)malloc(size)) {
-    memset(left_, 0, size);
-    if (right_ = (char*)malloc(size)) {
-      memset(right_, 0, size);
-      return 0;
-    }
+  DiffBatch() : first(false), last(false), arena(NULL), failed(false) {}
+  ~DiffBatch() {
+    for (size_t i = 0; i < diffs.size(); i++)
+      delete diffs[i];
+    delete arena;
   }
-  if (left_) free(left_);
-  return -1;
-}
+  std::string filename;
+  bool first;
+  bool last;
+  std::vector<Diff*> diffs;
+  Arena* arena;
+  bool failed; // the parser threw after these diffs
+  AppException error;
+};
 
-void Writer::header(const char* filename)
+// -j 1 over a stream: the analyzer runs on a parser thread and hands the
+// printer DIFF_BATCH_SIZE diffs at a time through a bounded queue.  With
+// the reader thread of the Reader this is a pipeline of three stages,
+// so a slow `svn diff |` is parsed and printed as it arrives and a fast
+// one takes about as long as its slowest stage.  The header of a file is
+// sized from the hunks of its first batch, and the later batches are
+// printed as they come
+template <class W>
+class PipelinePrinter
 {
-  char l_line[FILENAMESIZE+5];
-  char r_line[FILENAMESIZE+5];
-  memset(l_line, 0, sizeof(l_line));
-  memset(r_line, 0, sizeof(r_line));
-  sprintf(l_line, "org: %s", filename);
-  sprintf(r_line, "new: %s", filename);
-  format(0, l_line, 0, r_line, MODE_EQL);
-  separator();
-}
+public:
+  PipelinePrinter(Analyzer* analyzer, W* writer, int context, bool intraline,
+                  RenderCache* cache);
+  ~PipelinePrinter();
+  void print();
+private:
+  static void* parser_main(void* arg);
+  void parse();
+  void render_file();
+  void stop();
+  bool stopping() { return __atomic_load_n(&stopping_, __ATOMIC_RELAXED); }
+  Analyzer* analyzer_;
+  Printer<W>* printer_;
+  SpscQueue<DiffBatch> queue_;
+  pthread_t thread_;
+  bool running_;
+  bool stopping_;
+  bool drained_; // the end of the queue was popped
+  bool cached_;  // files are rendered whole, for the render cache
+  std::vector<DiffBatch*> file_; // batches held until the file is complete
+  std::string filename_;
+  Stats stats_;  // the parser thread's, once it ends
+};
 
-void Writer::separator()
+template <class W>
+PipelinePrinter<W>::PipelinePrinter(Analyzer* analyzer, W* writer, int context,
+                                    bool intraline, RenderCache* cache)
+  : analyzer_(analyzer), printer_(new Printer<W>(NULL, writer)),
+    queue_(DIFF_BATCHES), running_(false), stopping_(false), drained_(false)
 {
-  memset(left_, 0, sizeof(left_));
-  memset(right_, 0, sizeof(right_));
-  memset(left_, '-', colum_);
-  memset(right_, '-', colum_);
-  fprintf(fp_, "------%s-+-+-------%s\n", left_, right_);
+  printer_->set_context(context);
+  printer_->set_intraline(intraline);
+  printer_->set_cache(cache);
+  cached_ = cache != NULL;
+  memset(&stats_, 0, sizeof(stats_));
+  if (pthread_create(&thread_, NULL, parser_main, this))
+    THROW_EXCEPTION("pthread_create() failed");
+  running_ = true;
 }
 
-void Writer::format(int lno, const char* l, int rno, const char* r, char mode)
+template <class W>
+PipelinePrinter<W>::~PipelinePrinter()
 {
-  char lno_str[6];
-  char rno_str[6];
-
-  while (l || r) {
-    if (l)
-      l = folding(l, left_);
-    else {
-      folding("", left_);
-      lno = 0;
-    }
-    if (r)
-      r = folding(r, right_);
-    else {
-      folding("", right_);
-      rno = 0;
-    }
-
-    strcpy(lno_str, "     ");
-    strcpy(rno_str, "     ");
-    if (lno > 0)
-      sprintf(lno_str, "%5d", lno);
-    if (rno > 0)
-      sprintf(rno_str, "%5d", rno);
-    lno = rno = 0;
-
-    fprintf(fp_, "%s %s |%c| %s %s\n", lno_str, left_, mode, rno_str, right_);
-  }
-  return;
+  stop();
+  for (size_t i = 0; i < file_.size(); i++)
+    delete file_[i];
+  delete printer_;
+  delete analyzer_;
 }
 
-void Writer::LF()
+// lets the parser run out, dropping what it still hands over
+template <class W>
+void PipelinePrinter<W>::stop()
 {
-  fprintf(fp_, "\n");
+  if (!running_)
+    return;
+  __atomic_store_n(&stopping_, true, __ATOMIC_RELAXED);
+  while (!drained_) {
+    DiffBatch* batch = queue_.pop();
+    if (!batch) drained_ = true;
+    delete batch;
+  }
+  pthread_join(thread_, NULL);
+  add_stats(stats_);
+  running_ = false;
 }
 
-char* Writer::folding(const char* _in, char* out)
+template <class W>
+void* PipelinePrinter<W>::parser_main(void* arg)
 {
-  int sz;
-  int col;
-  int colsum = 0;
-  unsigned char* in = (unsigned char*)_in;
-
-  while (*in) {
-    getcolumsz(in, &sz, &col);
-    if (colsum + col > colum_) break;
-    memcpy(out,in, sz);
-    in += sz;
-    out += sz;
-    colsum += col;
-  }
-  if (colsum < colum_)
-    for (; colsum != colum_; colsum++)
-      *out++ = ' ';
-  *out = 0;
-  if (*in)
-    return (char*)in;
+  PipelinePrinter* printer = (PipelinePrinter*)arg;
+  if (trace_enabled) trace_thread("parser");
+  printer->parse();
+  printer->stats_ = stats;
   return NULL;
 }
 
-void Writer::encoding_check(unsigned char* in)
+template <class W>
+void PipelinePrinter<W>::parse()
 {
-  static unsigned char enc_chk = ENCODING_UTF8 | ENCODING_EUC | ENCODING_SJIS;
-
-  if (encoding_ == ENCODING_UNKNOWN) {
-    if (!is_ascii(*in)) {
-      if (!is_utf8_2byte(in) && !is_utf8_3byte(in)) {
-        enc_chk &= ~ENCODING_UTF8;
-      }
-      if (!is_euc_hankana(in) && !is_euc_zenkaku(in)) {
-        enc_chk &= ~ENCODING_EUC;
-      }
-      if (!is_sjis_hankana(*in) && !is_sjis_zenkaku(in)) {
-        enc_chk &= ~ENCODING_SJIS;
-      }
-      if (enc_chk == ENCODING_UTF8) {
-        encoding_ = ENCODING_UTF8;
-      }
-      if (enc_chk == ENCODING_EUC) {
-        encoding_ = ENCODING_EUC;
+  DiffBatch* batch = NULL;
+  try {
+    while (!stopping()) {
+      const char* filename;
+      {
+        Stage stage(STAGE_PARSE);
+        Span span("getsrc");
+        if (!(filename = analyzer_->getsrc()))
+          break;
+        trace_file(filename);
       }
-      if (enc_chk == ENCODING_SJIS) {
-        encoding_ = ENCODING_SJIS;
+      batch = new DiffBatch;
+      batch->first = true;
+      batch->filename = filename;
+      while (!stopping()) {
+        Diff* diff;
+        {
+          Stage stage(STAGE_PARSE);
+          Span span("getdiff");
+          diff = analyzer_->getdiff();
+        }
+        if (!diff) break;
+        batch->diffs.push_back(diff);
+        if (batch->diffs.size() == DIFF_BATCH_SIZE) {
+          batch->arena = analyzer_->cut_arena();
+          queue_.push(batch);
+          batch = new DiffBatch;
+        }
       }
+      batch->arena = analyzer_->take_arena();
+      batch->last = true;
+      queue_.push(batch);
+      batch = NULL;
     }
+  } catch (AppException& e) {
+    if (!batch) batch = new DiffBatch;
+    batch->arena = analyzer_->take_arena();
+    batch->failed = true;
+    batch->error = e;
+    queue_.push(batch);
   }
+  queue_.push(NULL);
 }
 
-void Writer::getcolumsz(unsigned char* in, int* sz, int* col)
+template <class W>
+void PipelinePrinter<W>::print()
 {
-  *sz = 1;
-  *col = 1;
-
-  //encoding_check(in);
-
-  if (encoding_ == ENCODING_UNKNOWN) {
-    if (is_ascii(*in)) {
-      *sz = 1;
-      *col = 1;
-    } else if (is_utf8_3byte(in)) {
-      *sz = 3;
-      *col = 2;
-    } else if (is_utf8_2byte(in)  ||
-               is_euc_zenkaku(in) ||
-               is_sjis_zenkaku(in)) {
-      *sz = 2;
-      *col = 2;
-    } else if (is_euc_hankana(in)) {
-      *sz = 2;
-      *col = 1;
-    } else if (is_sjis_hankana(*in)) {
-      *sz = 1;
-      *col = 1;
-    }
-  } else if (encoding_ == ENCODING_UTF8) {
-    if (is_utf8_2byte(in)) {
-      *sz = 2;
-      *col = 2;
-    } else if (is_utf8_3byte(in)) {
-      *sz = 3;
-      *col = 2;
+  while (DiffBatch* batch = queue_.pop()) {
+    file_.push_back(batch);
+    if (batch->failed) {
+      stop();
+      throw batch->error;
     }
-  } else if (encoding_ == ENCODING_SJIS) {
-    if (is_sjis_hankana(*in)) {
-      *sz = 1;
-      *col = 1;
-    } else if (is_sjis_zenkaku(in)) {
-      *sz = 2;
-      *col = 2;
+    if (cached_ || (batch->first && batch->last)) {
+      if (batch->last) render_file();
+      continue;
     }
-  } else if (encoding_ == ENCODING_EUC) {
-    if (is_euc_hankana(in)) {
-      *sz = 2;
-      *col = 1;
-    } else if (is_euc_zenkaku(in)) {
-      *sz = 2;
-      *col = 2;
+    try {
+      if (batch->first) {
+        filename_ = batch->filename;
+        printer_->begin_file(filename_.c_str(), &batch->diffs);
+      }
+      printer_->render_diffs(&batch->diffs);
+      if (batch->last) printer_->end_file();
+    } catch (AppException&) {
+      stop();
+      throw;
     }
+    delete batch;
+    file_.clear();
   }
+  drained_ = true;
+  stop();
 }
 
-class Printer
+// the batches in file_ at once, as the render cache keys on all of a
+// file's hunks; a file of one batch takes this way as well
+template <class W>
+void PipelinePrinter<W>::render_file()
 {
-public:
-  Printer(Analyzer* analyzer, Writer* writer)
-    : analyzer_(analyzer), writer_(writer), reader_(0), sno_(0), dno_(0) {}
-  ~Printer() {
-    delete analyzer_;
-    delete writer_;
+  std::vector<Diff*> diffs;
+  for (size_t i = 0; i < file_.size(); i++) {
+    diffs.insert(diffs.end(), file_[i]->diffs.begin(), file_[i]->diffs.end());
+    file_[i]->diffs.clear();
   }
-  void print();
-private:
-  void print_equal_line(Diff* diff);
-  void print_diff_line(Diff* diff);
-  const char* reader_skip(int count);
-  Reader* reader();
-  void print_final();
-  Analyzer* analyzer_;
-  Writer* writer_;
-  Reader* reader_;
-  const char* filename_;
-  int sno_;
-  int dno_;
-};
-
-void Printer::print()
-{
-  while (filename_ = analyzer_->getsrc()) {
-    writer_->header(filename_);
-    while (Diff* diff = analyzer_->getdiff()) {
-      // diff->debug();
-      print_equal_line(diff);
-      print_diff_line(diff);
-      delete diff;
-    }
-    print_final();
-    writer_->LF();
-    writer_->LF();
+  try {
+    printer_->render(file_[0]->filename.c_str(), &diffs);
+  } catch (AppException&) {
+    for (size_t i = 0; i < diffs.size(); i++)
+      delete diffs[i];
+    stop();
+    throw;
   }
+  for (size_t i = 0; i < file_.size(); i++)
+    delete file_[i];
+  file_.clear();
 }
 
-void Printer::print_equal_line(Diff* diff)
+template <class W>
+void Printer<W>::print_equal_line(Diff* diff)
 {
   Line* src = diff->src();
   Line* dst = diff->dst();
-  int s_l = 0, d_l = 0, e_l = 0;
+  lno_t s_l = 0, d_l = 0, e_l = 0;
+  Stage stage(STAGE_EQUAL);
+  Span span("print_equal_line");
 
   if (src) s_l = (src->start() - 1) - sno_;
   if (dst) d_l = (dst->start() - 1) - dno_;
@@ -956,71 +4613,100 @@ void Printer::print_equal_line(Diff* diff)
     e_l = d_l;
   }
 
-  while (e_l--) {
-    char* line = reader()->readline();
+  // with a context window, the middle of a long gap is stepped over:
+  // the previous hunk keeps context_ lines after it, this one before it
+  if (context_ >= 0 && e_l > 0) {
+    lno_t head = hunks_ ? context_ : 0;
+    if (e_l > head + context_) {
+      print_equal(head);
+      skip(e_l - head - context_);
+      e_l = context_;
+    }
+  }
+  print_equal(e_l);
+  hunks_++;
+}
+
+template <class W>
+void Printer<W>::print_equal(lno_t lines)
+{
+  while (lines-- > 0) {
+    NormLine line;
+    source()->readline(&line);
     sno_++;
     dno_++;
     writer_->format(sno_, line, dno_, line, MODE_EQL);
   }
 }
 
-void Printer::print_diff_line(Diff* diff)
+// equal lines neither read nor formatted, only counted
+template <class W>
+void Printer<W>::skip(lno_t lines)
+{
+  source()->skip(lines);
+  sno_ += lines;
+  dno_ += lines;
+  writer_->skipped(lines);
+  stats.skipped_lines += lines;
+}
+
+template <class W>
+void Printer<W>::print_diff_line(Diff* diff)
 {
+  Span span("print_diff_line");
   Line* src = diff->src();
   Line* dst = diff->dst();
 
   while (1) {
-    std::string *s_str = NULL, *d_str = NULL;
-    const char *s_l = NULL, *d_l = NULL;
-
-    if (src) {
-      if (s_str = src->getstr()) {
-        s_l = s_str->c_str();
-        sno_++;
-      }
-    }
-    if (dst) {
-      if (d_str = dst->getstr()) {
-        d_l = d_str->c_str();
-        dno_++;
-      }
-    }
-    if (!s_l && !d_l) break;
-    writer_->format(sno_, s_l, dno_, d_l, diff->mode());
-    if (s_str) delete s_str;
-    if (d_str) delete d_str;
+    NormLine s_l, d_l;
+    if (src && src->getstr(&s_l)) sno_++;
+    if (dst && dst->getstr(&d_l)) dno_++;
+    if (!s_l.ptr && !d_l.ptr) break;
+    if (intra_ && s_l.ptr && d_l.ptr && diff->mode() == MODE_MOD &&
+        intra_->compare(s_l, d_l))
+      writer_->format(sno_, s_l, dno_, d_l, diff->mode(),
+                      intra_->src_marks(), intra_->dst_marks());
+    else
+      writer_->format(sno_, s_l, dno_, d_l, diff->mode());
   }
 
   if (dst)
-    reader_skip(dst->end() - (dst->start()-1));
-}
-
-const char* Printer::reader_skip(int count)
-{
-  while(count--) {
-    reader()->readline();
-  }
+    source()->seek(dst->end());
 }
 
-Reader* Printer::reader()
+template <class W>
+Source* Printer<W>::source()
 {
-  if (!reader_) reader_ = new Reader(filename_);
-  return reader_;
+  if (!source_) source_ = new Source(filename_, writer_->encoding());
+  return source_;
 }
 
-void Printer::print_final()
+template <class W>
+void Printer<W>::print_final()
 {
-  if (reader_) {
-    while (char* line = reader_->readline()) {
+  Stage stage(STAGE_EQUAL);
+  Span span("print_final");
+  if (source_) {
+    NormLine line;
+    for (lno_t i = 0; context_ < 0 || i < context_; i++) {
+      if (!source_->readline(&line))
+        break;
       sno_++;
       dno_++;
       writer_->format(sno_, line, dno_, line, MODE_EQL);
     }
-    delete reader_;
+    if (context_ >= 0) {
+      if (lno_t rest = source_->skip_rest()) {
+        writer_->skipped(rest);
+        stats.skipped_lines += rest;
+      }
+    }
+    delete source_;
   }
-  reader_ = 0;
+  source_ = 0;
   sno_ = 0;
   dno_ = 0;
+  hunks_ = 0;
 }
 
 void print_version()
@@ -1035,8 +4721,8 @@ void print_help(const char* prog)
     prog++;
   }
   const char* msg =
-    "%s [-h|-v|-c colum|-f difftext|-d old_src_dir"
-    "|--euc|--sjis|--utf8|--usage|]\n";
+    "%s [-h|-v|-c colum|-b bufsize|-j threads|-m budget|-U lines|-f difftext|-d old_src_dir"
+    "|--euc|--sjis|--utf8|--no-cache|--no-pipeline|--watch|--render-cache dir|--render-cache-size 256m|--intraline|--color|--html|--trace out.json|--stats|--usage|]\n";
   fprintf(stderr, msg, prog);
 }
 
@@ -1053,9 +4739,208 @@ void print_usage(const char* prog)
     "ex.4) cvs diff -c 120 | %s > outfile\n"
     "ex.5) %s < difftext > outfile\n"
     "ex.6) %s -f difftext > outfile\n"
-    "ex.7) %s -d ../old_src_dir > outfile\n";
+    "ex.7) %s -d ../old_src_dir > outfile\n"
+    "ex.8) %s -d ../old_src_dir --intraline --html > outfile.html\n"
+    "ex.9) %s -d ../old_src_dir --watch > outfile\n";
   fprintf(stderr, msg,
-          prog, prog, prog, prog, prog, prog, prog);
+          prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+const char* encoding_name(int encoding)
+{
+  switch (encoding) {
+  case ENCODING_UTF8: return "utf8";
+  case ENCODING_SJIS: return "sjis";
+  case ENCODING_EUC:  return "euc";
+  }
+  return "auto";
+}
+
+// one detection pass over a sample of the input, before any line has
+// been normalized; the head of -f difftext, the Reader window of a piped
+// diff or the first files of both trees for a directory comparison
+int detect_encoding(Reader* reader, DirAnalyzer* dir, const char* difftext)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  EncodingDetector detector;
+  if (dir) {
+    for (size_t i = 0; i < dir->files() && i < DETECT_SOURCE_FILES; i++) {
+      detector.feed_file(dir->old_path(i).c_str(), DETECT_SOURCE_SIZE);
+      detector.feed_file(dir->new_path(i), DETECT_SOURCE_SIZE);
+    }
+  } else if (difftext) {
+    detector.feed_file(difftext, DETECT_SAMPLE_SIZE, true);
+  } else {
+    std::string window;
+    for (int i = 0; reader->raw(i).ptr; i++)
+      window.append(reader->raw(i).ptr, reader->raw(i).len);
+    detector.feed_diff(StrRef(window.data(), window.size()));
+  }
+  int encoding = detector.result();
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  stats.detect_bytes = detector.bytes();
+  stats.detect_msec = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  return encoding;
+}
+
+#ifndef DIFFEDIT_NO_MAIN
+// every operator new is counted for --stats, one thread-local increment;
+// both are kept out of line, so the compiler does not see new's memory
+// handed to free() and warn of a mismatch
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  stats.allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+  operator delete(p);
+}
+#endif
+
+static void stats_sample(int)
+{
+  stats.stage_samples[stats.stage]++;
+}
+
+// starts the stage clock and a SIGPROF every STATS_SAMPLE_USEC of CPU
+// time, which charges the sample to the stage of the thread it hits
+void start_stats()
+{
+  stats_enabled = true;
+  stats.stage_since = ticks();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  struct itimerval it;
+  it.it_interval.tv_sec = it.it_value.tv_sec = 0;
+  it.it_interval.tv_usec = it.it_value.tv_usec = STATS_SAMPLE_USEC;
+  setitimer(ITIMER_PROF, &it, NULL);
+}
+
+static double tv_msec(const struct timeval& tv)
+{
+  return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+void print_stats()
+{
+  struct itimerval it;
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, &it, NULL);
+  enter_stage(stats.stage);
+  double wall = tick_clock.msec();
+  double msec_per_tick = tick_clock.msec_per_tick();
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  if (stats.encoding_by)
+    fprintf(stderr, "encoding: %s (%s)\n",
+            encoding_name(stats.encoding), stats.encoding_by);
+  else
+    fprintf(stderr, "encoding: %s (detected from %ld bytes in %.3f ms)\n",
+            encoding_name(stats.encoding), stats.detect_bytes, stats.detect_msec);
+  fprintf(stderr, "reader: %ld readers, %ld lines, %ld bytes, %ld normalized\n",
+          stats.readers, stats.reader_lines, stats.reader_bytes, stats.reader_normalized);
+  fprintf(stderr, "analyzer: %ld files, %ld hunks\n", stats.files, stats.hunks);
+  fprintf(stderr, "source: %ld lines, %ld normalized\n",
+          stats.source_lines, stats.source_normalized);
+  fprintf(stderr, "writer: %ld rows, %ld folds measured, %ld folds scanned, %ld lines skipped\n",
+          stats.writer_rows, stats.fold_measured, stats.fold_scanned, stats.skipped_lines);
+  fprintf(stderr, "output: %ld bytes\n", stats.out_bytes);
+  fprintf(stderr, "arena: %ld bytes spilled\n", stats.spill_bytes);
+  fprintf(stderr, "intraline: %ld rows compared, %ld capped\n",
+          stats.intra_rows, stats.intra_capped);
+  fprintf(stderr, "render cache: %ld hits, %ld misses, %ld bytes evicted\n",
+          stats.render_hits, stats.render_misses, stats.render_evicted);
+
+  // wall is summed over the threads in a stage.  The kernel may deliver
+  // one SIGPROF for several intervals, so the samples only apportion the
+  // process cpu time between the stages
+  static const char* names[STAGES] = { "other", "read", "parse", "equal", "fold", "write" };
+  double cpu = tv_msec(ru.ru_utime) + tv_msec(ru.ru_stime);
+  long samples = 0;
+  for (int i = 0; i < STAGES; i++)
+    samples += stats.stage_samples[i];
+  fprintf(stderr, "stage     wall ms    cpu ms\n");
+  for (int i = 1; i <= STAGES; i++) {
+    int k = i % STAGES; // other last
+    fprintf(stderr, "%-6s %10.3f %9.3f\n", names[k], stats.stage_ticks[k] * msec_per_tick,
+            samples ? cpu * stats.stage_samples[k] / samples : 0.0);
+  }
+  fprintf(stderr, "total: %.3f ms wall, %.3f ms cpu (%.3f user, %.3f sys), %ld samples\n",
+          wall, cpu, tv_msec(ru.ru_utime), tv_msec(ru.ru_stime), samples);
+  fprintf(stderr, "memory: %ld KB peak rss, %ld allocations\n",
+          ru.ru_maxrss, stats.allocations);
+}
+
+// a file name as a JSON string; bytes that are not UTF-8 (SJIS or EUC
+// names) are kept one \u00XX each, so the file stays valid JSON
+static void put_json(FILE* fp, const std::string& str)
+{
+  const unsigned char* in = (const unsigned char*)str.data();
+  const unsigned char* end = in + str.size();
+  fputc('"', fp);
+  while (in != end) {
+    uint32_t cp;
+    int sz = (*in & 0x80) ? utf8_decode(in, end - in, &cp) : 1;
+    if (sz > 1) {
+      fwrite(in, 1, sz, fp);
+      in += sz;
+      continue;
+    }
+    if (*in == '"' || *in == '\\') fprintf(fp, "\\%c", *in);
+    else if (*in < 0x20 || *in >= 0x80) fprintf(fp, "\\u%04x", *in);
+    else fputc(*in, fp);
+    in++;
+  }
+  fputc('"', fp);
+}
+
+// the spans of every thread as Chrome trace events: complete ("X")
+// events in microseconds since start, and a name for each thread
+void write_trace(const char* filename)
+{
+  FILE* fp = fopen(filename, "w");
+  if (!fp) THROW_EXCEPTION("fopen(%s) %s", filename, strerror(errno));
+  double usec_per_tick = tick_clock.msec_per_tick() * 1e3;
+  long pid = getpid();
+  const char* sep = "";
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (TraceBuffer* b = __atomic_load_n(&trace_threads, __ATOMIC_ACQUIRE); b; b = b->next) {
+    fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, \"tid\": %ld, "
+            "\"args\": {\"name\": \"%s\", \"dropped\": %ld}}", sep, pid, b->tid, b->thread, b->dropped);
+    sep = ",\n";
+    for (size_t i = 0; i < b->events.size(); i++) {
+      const TraceEvent& e = b->events[i];
+      fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+              "\"pid\": %ld, \"tid\": %ld", e.name, (e.begin - tick_clock.ticks0) * usec_per_tick,
+              (e.end - e.begin) * usec_per_tick, pid, b->tid);
+      if (e.file >= 0) {
+        fprintf(fp, ", \"args\": {\"file\": ");
+        put_json(fp, b->files[e.file]);
+        fputc('}', fp);
+      }
+      fputc('}', fp);
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp)) THROW_EXCEPTION("fclose(%s) %s", filename, strerror(errno));
 }
 
 struct option
@@ -1064,8 +4949,33 @@ struct option
   const char* old_src_dir;
   int colum;
   int encoding;
+  const char* encoding_by;
+  size_t bufsize;
+  int threads;
+  int context;
+  size_t budget;
+  bool no_cache;
+  bool no_pipeline;
+  bool watch;
+  const char* render_cache;
+  size_t render_cache_size;
+  bool intraline;
+  int backend;
+  const char* trace;
+  bool stats;
 };
 
+// bytes, with an optional k, m or g suffix
+size_t parse_size(const char* arg)
+{
+  char* end;
+  size_t size = strtoul(arg, &end, 10);
+  if (*end == 'k' || *end == 'K') size *= 1024;
+  if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+  if (*end == 'g' || *end == 'G') size *= 1024 * 1024 * 1024;
+  return size;
+}
+
 int parse_arg(int argc, char** argv, struct option* opt)
 {
   for (int i = 1; i < argc; i++) {
@@ -1082,6 +4992,31 @@ int parse_arg(int argc, char** argv, struct option* opt)
         opt->old_src_dir = argv[i];
         continue;
       }
+      if (!strcmp(arg, "-b")) {
+        if (++i >= argc) return -1;
+        opt->bufsize = parse_size(argv[i]);
+        if (!opt->bufsize) return -1;
+        continue;
+      }
+      if (!strcmp(arg, "-U")) {
+        if (++i >= argc) return -1;
+        opt->context = atoi(argv[i]);
+        if (opt->context < 0) return -1;
+        continue;
+      }
+      if (!strcmp(arg, "-m")) {
+        if (++i >= argc) return -1;
+        opt->budget = parse_size(argv[i]);
+        if (!opt->budget) return -1;
+        continue;
+      }
+      if (!strcmp(arg, "-j")) {
+        if (++i >= argc) return -1;
+        opt->threads = atoi(argv[i]);
+        if (opt->threads <= 0)
+          opt->threads = sysconf(_SC_NPROCESSORS_ONLN);
+        continue;
+      }
       if (!strcmp(arg, "-c")) {
         if (++i >= argc) return -1;
         opt->colum = atoi(argv[i]);
@@ -1096,18 +5031,68 @@ int parse_arg(int argc, char** argv, struct option* opt)
         return -1;
       }
       if (!strcmp(arg, "--euc")) {
-        if (opt->encoding == ENCODING_UNKNOWN)
+        if (opt->encoding == ENCODING_UNKNOWN) {
           opt->encoding = ENCODING_EUC;
+          opt->encoding_by = arg;
+        }
         continue;
       }
       if (!strcmp(arg, "--sjis")) {
-        if (opt->encoding == ENCODING_UNKNOWN)
+        if (opt->encoding == ENCODING_UNKNOWN) {
           opt->encoding = ENCODING_SJIS;
+          opt->encoding_by = arg;
+        }
         continue;
       }
       if (!strcmp(arg, "--utf8")) {
-        if (opt->encoding == ENCODING_UNKNOWN)
+        if (opt->encoding == ENCODING_UNKNOWN) {
           opt->encoding = ENCODING_UTF8;
+          opt->encoding_by = arg;
+        }
+        continue;
+      }
+      if (!strcmp(arg, "--no-cache")) {
+        opt->no_cache = true;
+        continue;
+      }
+      if (!strcmp(arg, "--no-pipeline")) {
+        opt->no_pipeline = true;
+        continue;
+      }
+      if (!strcmp(arg, "--watch")) {
+        opt->watch = true;
+        continue;
+      }
+      if (!strcmp(arg, "--render-cache")) {
+        if (++i >= argc) return -1;
+        opt->render_cache = argv[i];
+        continue;
+      }
+      if (!strcmp(arg, "--render-cache-size")) {
+        if (++i >= argc) return -1;
+        opt->render_cache_size = parse_size(argv[i]);
+        if (!opt->render_cache_size) return -1;
+        continue;
+      }
+      if (!strcmp(arg, "--intraline")) {
+        opt->intraline = true;
+        continue;
+      }
+      if (!strcmp(arg, "--color")) {
+        opt->backend = BACKEND_ANSI;
+        continue;
+      }
+      if (!strcmp(arg, "--html")) {
+        opt->backend = BACKEND_HTML;
+        continue;
+      }
+      if (!strcmp(arg, "--trace")) {
+        if (++i >= argc) return -1;
+        opt->trace = argv[i];
+        continue;
+      }
+      if (!strcmp(arg, "--stats")) {
+        opt->stats = true;
         continue;
       }
       if (!strcmp(arg, "--usage")) {
@@ -1118,38 +5103,307 @@ int parse_arg(int argc, char** argv, struct option* opt)
       return -1;
     }
   }
+  if (opt->watch && !opt->old_src_dir) {
+    fprintf(stderr, "--watch needs -d\n");
+    return -1;
+  }
   return 0;
 }
 
+// --watch over -d.  The rendered block of every file that differs is
+// kept in memory, in tree order, and the output file is patched in
+// place: each settled burst of events relists both trees, the files
+// touched or new since the last pass are compared and rendered again,
+// and only the blocks that changed or moved are written back
+template <class Enc, class Backend>
+class WatchPrinter
+{
+public:
+  WatchPrinter(struct option* opt);
+  ~WatchPrinter() { delete printer_; }
+  void set_cache(RenderCache* cache) { printer_->set_cache(cache); }
+  void run(DirAnalyzer* dir);
+private:
+  typedef Writer<Enc, Backend> W;
+  void render(DirAnalyzer* dir);
+  void write_out(const std::set<std::string>& changed);
+  void put(const std::string& key, const std::string& text, off_t* off, bool changed);
+  struct option* opt_;
+  Printer<W>* printer_;
+  std::vector<std::string> files_;             // both trees' files, in order
+  std::map<std::string, std::string> blocks_;  // of the files that differ
+  std::map<std::string, off_t> offsets_;       // where each block was written
+  std::string head_;
+  std::string tail_;
+  off_t size_;
+};
+
+template <class Enc, class Backend>
+WatchPrinter<Enc, Backend>::WatchPrinter(struct option* opt)
+  : opt_(opt), printer_(new Printer<W>(NULL, new W(opt->colum, NULL))), size_(-1)
+{
+  printer_->set_context(opt->context);
+  printer_->set_intraline(opt->intraline);
+  struct stat st;
+  if (fstat(STDOUT_FILENO, &st) < 0 || !S_ISREG(st.st_mode))
+    THROW_EXCEPTION("--watch needs the output redirected to a file");
+  // pwrite() ignores the offset under O_APPEND
+  int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (flags >= 0 && (flags & O_APPEND))
+    fcntl(STDOUT_FILENO, F_SETFL, flags & ~O_APPEND);
+  OutBuf frame(-1, JOB_OUTBUF_SIZE);
+  Backend::begin(&frame, Enc::id);
+  head_.assign(frame.data(), frame.size());
+  frame.clear();
+  Backend::end(&frame);
+  tail_.assign(frame.data(), frame.size());
+}
+
+// takes dir over; returns on SIGINT or SIGTERM
+template <class Enc, class Backend>
+void WatchPrinter<Enc, Backend>::run(DirAnalyzer* dir)
+{
+  for (size_t i = 0; i < dir->files(); i++)
+    files_.push_back(dir->new_path(i));
+  try {
+    render(dir);
+  } catch (AppException&) {
+    delete dir;
+    throw;
+  }
+  delete dir;
+  write_out(std::set<std::string>());
+
+  TreeWatcher watcher(opt_->old_src_dir);
+  std::set<std::string> touched;
+  bool all;
+  while (watcher.wait(&touched, &all)) {
+    dir = new DirAnalyzer(opt_->old_src_dir, opt_->encoding, opt_->threads, false);
+    std::set<std::string> known(files_.begin(), files_.end());
+    std::set<std::string> listed, again;
+    files_.clear();
+    for (size_t i = 0; i < dir->files(); i++) {
+      std::string path = dir->new_path(i);
+      files_.push_back(path);
+      listed.insert(path);
+      if (all || touched.count(path) || !known.count(path))
+        again.insert(path);
+    }
+    // the blocks of files to render again, or gone from either tree
+    std::map<std::string, std::string> old;
+    for (std::map<std::string, std::string>::iterator it = blocks_.begin();
+         it != blocks_.end(); ) {
+      if (again.count(it->first) || !listed.count(it->first)) {
+        old[it->first].swap(it->second);
+        blocks_.erase(it++);
+      } else {
+        it++;
+      }
+    }
+    dir->keep_only(again);
+    try {
+      render(dir);
+    } catch (AppException& e) {
+      // a file caught halfway through being written; the next event
+      // for it brings it up to date
+      fprintf(stderr, "%s\n", e.what());
+    }
+    delete dir;
+    std::set<std::string> changed;
+    for (std::set<std::string>::iterator it = again.begin(); it != again.end(); it++) {
+      std::map<std::string, std::string>::iterator b = blocks_.find(*it);
+      std::map<std::string, std::string>::iterator o = old.find(*it);
+      if ((b == blocks_.end()) != (o == old.end()) ||
+          (b != blocks_.end() && b->second != o->second))
+        changed.insert(*it);
+    }
+    write_out(changed);
+  }
+}
+
+template <class Enc, class Backend>
+void WatchPrinter<Enc, Backend>::render(DirAnalyzer* dir)
+{
+  OutBuf block(-1, JOB_OUTBUF_SIZE);
+  printer_->writer()->set_out(&block);
+  while (const char* filename = dir->getsrc()) {
+    std::vector<Diff*> diffs;
+    while (Diff* diff = dir->getdiff())
+      diffs.push_back(diff);
+    block.clear();
+    printer_->render(filename, &diffs);
+    blocks_[filename].assign(block.data(), block.size());
+  }
+}
+
+// the pieces in order, each one written when it changed or moved since
+// the last pass; then the file is cut to its new length
+template <class Enc, class Backend>
+void WatchPrinter<Enc, Backend>::write_out(const std::set<std::string>& changed)
+{
+  off_t off = 0;
+  std::map<std::string, off_t> offsets;
+  offsets_.swap(offsets);
+  put("", head_, &off, false);
+  for (size_t i = 0; i < files_.size(); i++) {
+    std::map<std::string, std::string>::iterator it = blocks_.find(files_[i]);
+    if (it != blocks_.end()) {
+      std::map<std::string, off_t>::iterator o = offsets.find(it->first);
+      bool moved = o == offsets.end() || o->second != off;
+      put(it->first, it->second, &off, moved || changed.count(it->first));
+    }
+  }
+  put("", tail_, &off, off != size_);
+  if (off != size_ && ftruncate(STDOUT_FILENO, off) < 0)
+    THROW_EXCEPTION("ftruncate() %s", strerror(errno));
+  size_ = off;
+}
+
+template <class Enc, class Backend>
+void WatchPrinter<Enc, Backend>::put(const std::string& key, const std::string& text,
+                                     off_t* off, bool changed)
+{
+  if (changed || size_ < 0) {
+    Stage stage(STAGE_WRITE);
+    Span span("flush");
+    size_t done = 0;
+    while (done < text.size()) {
+      ssize_t n = pwrite(STDOUT_FILENO, text.data() + done, text.size() - done, *off + done);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        THROW_EXCEPTION("pwrite() %s", strerror(errno));
+      }
+      done += n;
+    }
+    stats.out_bytes += text.size();
+  }
+  if (!key.empty())
+    offsets_[key] = *off;
+  *off += text.size();
+}
+
+// the encoding and the backend are fixed for the whole run, so both are
+// bound at compile time
+template <class Enc, class Backend>
+void print_with(Analyzer* analyzer, struct option* opt, OutBuf* out, RenderCache* cache)
+{
+  typedef Writer<Enc, Backend> W;
+  if (opt->watch) {
+    WatchPrinter<Enc, Backend> printer(opt);
+    printer.set_cache(cache);
+    printer.run((DirAnalyzer*)analyzer);
+    return;
+  }
+  Backend::begin(out, Enc::id);
+  if (opt->threads > 1) {
+    ParallelPrinter<W>* printer =
+      new ParallelPrinter<W>(analyzer, opt->colum, opt->context,
+                             opt->intraline, cache, out, opt->threads);
+    try {
+      printer->print();
+    } catch (AppException&) {
+      delete printer;
+      throw;
+    }
+    delete printer;
+  } else if (!opt->no_pipeline && analyzer->streams()) {
+    PipelinePrinter<W>* printer =
+      new PipelinePrinter<W>(analyzer, new W(opt->colum, out), opt->context,
+                             opt->intraline, cache);
+    try {
+      printer->print();
+    } catch (AppException&) {
+      delete printer;
+      throw;
+    }
+    delete printer;
+  } else {
+    Printer<W>* printer = new Printer<W>(analyzer, new W(opt->colum, out));
+    printer->set_context(opt->context);
+    printer->set_intraline(opt->intraline);
+    printer->set_cache(cache);
+    printer->print();
+    delete printer;
+  }
+  Backend::end(out);
+}
+
+template <class Enc>
+void print(Analyzer* analyzer, struct option* opt, OutBuf* out, RenderCache* cache)
+{
+  switch (opt->backend) {
+  case BACKEND_ANSI: print_with<Enc, AnsiBackend>(analyzer, opt, out, cache);  break;
+  case BACKEND_HTML: print_with<Enc, HtmlBackend>(analyzer, opt, out, cache);  break;
+  default:           print_with<Enc, PlainBackend>(analyzer, opt, out, cache); break;
+  }
+}
+
+#ifndef DIFFEDIT_NO_MAIN
 int main(int argc, char** argv)
 {
   struct option opt;
   memset(&opt, 0, sizeof(opt));
   opt.colum = DEFAULT_COLUM;
+  opt.bufsize = DEFAULT_OUTBUF_SIZE;
+  opt.threads = 1;
+  opt.context = -1;
+  opt.render_cache_size = RENDER_CACHE_SIZE;
   if (parse_arg(argc, argv, &opt) < 0)
     return -1;
+  tick_clock.start();
+  if (opt.stats) start_stats();
+  if (opt.trace) {
+    trace_enabled = true;
+    trace_thread("main");
+  }
 
-  FILE* fp = NULL;
+  OutBuf* out = NULL;
+  RenderCache* cache = NULL;
   try {
-    Reader* reader;
+    out = new OutBuf(STDOUT_FILENO, opt.bufsize);
+    if (opt.render_cache)
+      cache = new RenderCache(opt.render_cache, opt.render_cache_size);
+    Reader* reader = NULL;
+    DirAnalyzer* dir = NULL;
+    // a -f file big enough is split and mapped under -j, not read
+    bool ahead = !opt.no_pipeline && !(opt.difftext && opt.threads > 1);
     if (opt.difftext)
-      reader = new Reader(opt.difftext);
-    else if (opt.old_src_dir) {
-      std::string cmd("diff ");
-      cmd.append(opt.old_src_dir);
-      cmd.append(" .");
-      if (!(fp = popen(cmd.c_str(), "r")))
-        THROW_EXCEPTION("popen(%s) %s\n", cmd.c_str(), strerror(errno));
-      reader = new Reader(fp);
-    } else reader = new Reader(); // stdin
-    Analyzer* analyzer = Analyzer::create(reader);
-    Printer* printer = new Printer(analyzer, new Writer(opt.colum, opt.encoding));
-    printer->print();
-    delete printer;
+      reader = new Reader(opt.difftext, opt.encoding, DEFAULT_READ_CACHE_SIZE, ahead);
+    else if (opt.old_src_dir)
+      dir = new DirAnalyzer(opt.old_src_dir, opt.encoding, opt.threads, !opt.no_cache);
+    else reader = new Reader(stdin, opt.encoding, DEFAULT_READ_CACHE_SIZE, ahead);
+    if (opt.encoding == ENCODING_UNKNOWN) {
+      opt.encoding = detect_encoding(reader, dir, opt.difftext);
+      if (reader) reader->set_encoding(opt.encoding);
+      if (dir) dir->set_encoding(opt.encoding);
+    } else {
+      stats.encoding_by = opt.encoding_by;
+    }
+    stats.encoding = opt.encoding;
+    Analyzer* analyzer = dir ? dir : Analyzer::create(reader);
+    if (opt.difftext)
+      analyzer = SplitAnalyzer::create(analyzer, opt.difftext, opt.encoding, opt.threads);
+    analyzer->set_budget(opt.budget);
+    switch (opt.encoding) {
+    case ENCODING_UTF8: print<EncodingUTF8>(analyzer, &opt, out, cache); break;
+    case ENCODING_SJIS: print<EncodingSJIS>(analyzer, &opt, out, cache); break;
+    case ENCODING_EUC:  print<EncodingEUC>(analyzer, &opt, out, cache);  break;
+    default:            print<EncodingAuto>(analyzer, &opt, out, cache); break;
+    }
   } catch (AppException& e) {
     fprintf(stderr, "%s\n", e.what());
   }
-  if (fp) pclose(fp);
+  delete out;
+  delete cache;
+  if (opt.stats) print_stats();
+  if (opt.trace) {
+    try {
+      write_trace(opt.trace);
+    } catch (AppException& e) {
+      fprintf(stderr, "%s\n", e.what());
+    }
+  }
 
   return 0;
 }
+#endif // DIFFEDIT_NO_MAIN
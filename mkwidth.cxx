@@ -0,0 +1,110 @@
+/*!
+ * generates widthtab.h, the byte class and display width tables used by
+ * diffedit (run by `make widthtab`, the output is checked in).  The widths
+ * are taken from wcwidth() of the C library in a UTF-8 locale, which
+ * follows Unicode East Asian Width.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+#include <vector>
+#include <map>
+#include <string>
+
+#define UCS_MAX (0x110000)
+#define BLOCK_BITS (8)
+#define BLOCK_SIZE (1 << BLOCK_BITS)
+
+// byte_class[] bits, mirrored in diffedit.cxx
+#define BC_UTF8_LEN   (0x07)
+#define BC_UTF8_TRAIL (0x08)
+#define BC_SJIS_LEAD  (0x10)
+#define BC_SJIS_TRAIL (0x20)
+#define BC_EUC        (0x40)
+#define BC_KANA       (0x80)
+
+static int byte_class(int c)
+{
+  int bc = 0;
+  if (c <= 0x7F) bc |= 1;
+  else if (0xC2 <= c && c <= 0xDF) bc |= 2;
+  else if (0xE0 <= c && c <= 0xEF) bc |= 3;
+  else if (0xF0 <= c && c <= 0xF4) bc |= 4;
+  if (0x80 <= c && c <= 0xBF) bc |= BC_UTF8_TRAIL;
+  if ((0x81 <= c && c <= 0x9F) || (0xE0 <= c && c <= 0xFC)) bc |= BC_SJIS_LEAD;
+  if ((0x40 <= c && c <= 0x7E) || (0x80 <= c && c <= 0xFC)) bc |= BC_SJIS_TRAIL;
+  if (0xA1 <= c && c <= 0xFE) bc |= BC_EUC;
+  if (0xA1 <= c && c <= 0xDF) bc |= BC_KANA;
+  return bc;
+}
+
+static int ucs_width(int cp)
+{
+  if (0xD800 <= cp && cp <= 0xDFFF)
+    return 1;
+  int w = wcwidth((wchar_t)cp);
+  if (w < 0) return 1; // controls and unassigned: one column as before
+  if (w > 2) return 2;
+  return w;
+}
+
+int main()
+{
+  if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8")) {
+    fprintf(stderr, "mkwidth: no UTF-8 locale available\n");
+    return 1;
+  }
+
+#ifdef __GLIBC__
+  printf("/* generated by mkwidth from glibc %s, do not edit */\n\n",
+         gnu_get_libc_version());
+#else
+  printf("/* generated by mkwidth, do not edit */\n\n");
+#endif
+
+  printf("static const unsigned char byte_class[256] = {");
+  for (int c = 0; c < 256; c++)
+    printf("%s0x%02x,", (c % 12) ? " " : "\n  ", byte_class(c));
+  printf("\n};\n\n");
+
+  // two-stage table: the code point's block picks one of the distinct
+  // blocks, each holding 2-bit widths for BLOCK_SIZE code points
+  std::vector<std::string> blocks;
+  std::map<std::string, int> seen;
+  std::vector<int> index;
+  for (int base = 0; base < UCS_MAX; base += BLOCK_SIZE) {
+    std::string block(BLOCK_SIZE / 4, '\0');
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      block[i / 4] |= ucs_width(base + i) << ((i % 4) * 2);
+    std::map<std::string, int>::iterator it = seen.find(block);
+    if (it == seen.end()) {
+      it = seen.insert(std::make_pair(block, (int)blocks.size())).first;
+      blocks.push_back(block);
+    }
+    index.push_back(it->second);
+  }
+
+  printf("#define UCS_WIDTH_BLOCK_BITS (%d)\n\n", BLOCK_BITS);
+  printf("static const %s ucs_width_index[%d] = {",
+         blocks.size() > 256 ? "unsigned short" : "unsigned char",
+         (int)index.size());
+  for (size_t i = 0; i < index.size(); i++)
+    printf("%s%d,", (i % 16) ? " " : "\n  ", index[i]);
+  printf("\n};\n\n");
+
+  printf("static const unsigned char ucs_width_block[%d][%d] = {",
+         (int)blocks.size(), BLOCK_SIZE / 4);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    printf("\n  {");
+    for (int i = 0; i < BLOCK_SIZE / 4; i++)
+      printf("%s0x%02x,", (i % 16) ? " " : "\n    ", (unsigned char)blocks[b][i]);
+    printf("\n  },");
+  }
+  printf("\n};\n");
+  return 0;
+}